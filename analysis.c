@@ -1,129 +1,300 @@
+#define _GNU_SOURCE
 #include "sniff.h"
 #include "dispatch.h"
 #include "analysis.h"
+#include "detector.h"
 #include "dynamic_array.h"
+#include "reassembly.h"
+#include "pcap_writer.h"
+#include "heavy_hitters.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <pcap.h>
+#include <pthread.h>
 #include <netinet/if_ether.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+// Mutex ensuring packet dumps from different threads are not interleaved,
+// and the number of packets dumped (guarded by it)
+pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long dump_count = 0;
+
+// Hooks of detectors built into the analyser
+static void* init_syn_state();
+static void merge_syn_state(void* dst, const void* src);
+static void report_syn_state(const void* state);
+static void free_syn_state(void* state);
+static size_t save_syn_state(const void* state, FILE* file);
+static void* restore_syn_state(void* data, size_t length);
+static void* init_arp_state();
+static void merge_arp_state(void* dst, const void* src);
+static void report_arp_state(const void* state);
+static size_t save_arp_state(const void* state, FILE* file);
+static void* restore_arp_state(void* data, size_t length);
+static void* init_blacklist_state();
+static void merge_blacklist_state(void* dst, const void* src);
+static void report_blacklist_state(const void* state);
+static size_t save_blacklist_state(const void* state, FILE* file);
+static void* restore_blacklist_state(void* data, size_t length);
+
+// Definitions of detectors built into the analyser
+const struct detector syn_detector = {
+	.name = "syn",
+	.layer = LAYER_IP,
+	.type = IPPROTO_TCP,
+	.init = init_syn_state,
+	.process = detect_syn,
+	.merge = merge_syn_state,
+	.report = report_syn_state,
+	.free = free_syn_state,
+	.save = save_syn_state,
+	.restore = restore_syn_state
+};
+const struct detector arp_detector = {
+	.name = "arp",
+	.layer = LAYER_ETHERNET,
+	.type = ETHERTYPE_ARP,
+	.init = init_arp_state,
+	.process = detect_arp,
+	.merge = merge_arp_state,
+	.report = report_arp_state,
+	.free = free,
+	.save = save_arp_state,
+	.restore = restore_arp_state
+};
+const struct detector blacklist_detector = {
+	.name = "blacklist",
+	.layer = LAYER_IP,
+	.type = IPPROTO_TCP,
+	.setup = initialise_reassembly,
+	.cleanup = free_reassembly,
+	.advance = advance_reassembly,
+	.init = init_blacklist_state,
+	.process = detect_blacklist_violation,
+	.merge = merge_blacklist_state,
+	.report = report_blacklist_state,
+	.free = free,
+	.save = save_blacklist_state,
+	.restore = restore_blacklist_state
+};
 
 
 /**
- * @brief Analyses a given packet by using the helper functions corresponding
- * with the ethernet type to update the global counter of attacks detected.
+ * @brief Registers the detectors built into the analyser before main runs,
+ * in the order their reports are displayed.
  * 
+ */
+__attribute__((constructor)) static void register_detectors() {
+	register_detector(&syn_detector);
+	register_detector(&arp_detector);
+	register_detector(&blacklist_detector);
+}
+
+
+/**
+ * @brief Analyses a given packet by passing it to the detectors attached to
+ * its ethernet type and IP protocol, which update the state of the calling
+ * thread, then passes it to the pcap writer.
+ * 
+ * @param context Detector context of the calling thread
  * @param header Header of packet to analyse
  * @param packet Remainder of packet to analyse
  */
-void analyse(const struct pcap_pkthdr* header, const unsigned char* packet) {
-
-	// Get ether header
-	struct ether_header* ether_header = (struct ether_header *) packet;
+void analyse(struct detector_context* context, const struct pcap_pkthdr* header, const unsigned char* packet) {
 
 	// Dump packet data if verbose flag enabled
 	if (verbose_enabled == 1) {
-		dump(packet, (*header).len);
+		pthread_mutex_lock(&dump_mutex);
+		dump(++dump_count, packet, (*header).caplen);
+		pthread_mutex_unlock(&dump_mutex);
 	}
 
-	// Analyse packet based on ethernet type
-	unsigned short ethernet_type = ntohs(ether_header->ether_type);
-	if (ethernet_type == ETHERTYPE_IP) {
-		detect_syn(packet + ETH_HLEN);
-	} else if (ethernet_type == ETHERTYPE_ARP) {
-		detect_arp(packet + ETH_HLEN);
-	}
+	// Record packet to file if it triggered a detection
+	int detections = run_detectors(context, header, packet);
+	record_packet(header, packet, detections);
 }
 
 
 /**
- * @brief 
- * This function analyzes an IP packet to find out if it is
- * a TCP packet and hence detect SYN and HTTP packets.
- * A SYN packet is detected by checking its header flags is
- * set only to SYN. We also add the source IP of all SYN packets
- * to a dynamic list to be analyzed as per the specification. 
+ * @brief Returns a pointer to the TCP header of a given IP packet, or NULL if
+ * the packet does not contain a complete TCP header.
  * 
- * HTTP packets are checked to see if any of the host addresses 
- * were blacklisted domains and the destination port was also 
- * 80.
- * @param packet 
+ * @param header Header of packet
+ * @param packet IP packet to parse
+ * @return struct tcphdr* Pointer to TCP header
  */
+static struct tcphdr* parse_tcp_header(const struct pcap_pkthdr* header, const unsigned char* packet) {
+
+	struct iphdr* ip_header = (struct iphdr*) packet;
+	unsigned int offset = ETH_HLEN + (ip_header->ihl * 4);
+
+	if (header->caplen < offset + sizeof(struct tcphdr)) {
+		return NULL;
+	}
+	return (struct tcphdr*) (packet + (ip_header->ihl * 4));
+}
+
 
 /**
- * @brief Detects potential SYN attacks by analysing a given IP packet, 
+ * @brief Detects potential SYN attacks by analysing a given TCP packet, 
  * inspecting the values of each of its header flags and updating the 
- * global attack counter. Passes HTTP packet to helper function to check 
- * for URL blacklist violations.
+ * SYN counter and the set of source IP addresses.
  * 
- * @param packet Packet to analyse
+ * @param state SYN detector state of the calling thread
+ * @param header Header of packet to analyse
+ * @param packet IP packet to analyse
+ * @return int 1 if a SYN packet was detected, 0 otherwise
  */
-void detect_syn(const unsigned char* packet) {
+int detect_syn(void* state, const struct pcap_pkthdr* header, const unsigned char* packet) {
 	
-	// Parse IP header
+	struct syn_state* syn = (struct syn_state*) state;
+
+	// Parse IP and TCP headers
 	struct iphdr* ip_header = (struct iphdr*) packet;
+	struct tcphdr* tcp_header = parse_tcp_header(header, packet);
+	if (tcp_header == NULL) {
+		return 0;
+	}
 
-	// Check if protocol is TCP (denoted by integer 6)
-	if (ip_header->protocol == 6) {
-
-		// Strip the IP header and parse the TCP header
-		const unsigned char* ip = packet + (ip_header->ihl * 4);
-		struct tcphdr* tcp_header = (struct tcphdr*) ip;
-
-		// Check if only SYN bit is set to 1 (indicates SYN attack)
-		if (tcp_header->syn == 1 && tcp_header->ack == 0 
-			&& tcp_header->urg == 0 && tcp_header->psh == 0 
-			&& tcp_header->rst == 0 && tcp_header->fin == 0
-		) {
-			attacks->syn_packets++;
-			
-			// Add IP address of packet in global array if not already stored
-			int new_ip_address = abs(ip_header->saddr);
-			if (contains(&ip_addresses, new_ip_address) == 0) {
-				insert(&ip_addresses, new_ip_address);
-			}
-		}
+	// Check if only SYN bit is set to 1 (indicates SYN attack)
+	if (tcp_header->syn == 1 && tcp_header->ack == 0 
+		&& tcp_header->urg == 0 && tcp_header->psh == 0 
+		&& tcp_header->rst == 0 && tcp_header->fin == 0
+	) {
+		syn->syn_packets++;
 
-		// If destination port is 80, check HTTP packet for URL blacklist violation
-		if (ntohs(tcp_header->dest) == 80) {
-			const char* http_packet = (char*) (ip + (tcp_header->doff * 4));
-			detect_blacklist_violation(http_packet);
+		// Count source IP address and destination IP address and port
+		add_heavy_hitter(&syn->sources, ip_header->saddr, 1, 0);
+		add_heavy_hitter(&syn->targets, 
+			((uint64_t) ip_header->daddr << 16) | ntohs(tcp_header->dest), 1, 0);
+		
+		// Add IP address of packet to array if not already stored
+		unsigned int new_ip_address = ip_header->saddr;
+		if (contains(&syn->ip_addresses, new_ip_address) == 0) {
+			insert(&syn->ip_addresses, new_ip_address);
 		}
+		return 1;
 	}
+	return 0;
 }
 
 
 /**
- * @brief Searches a HTTP packet containing a GET request for a blacklisted URL, 
- * updating the global counter if one is found.
+ * @brief Searches a block of HTTP headers containing a GET request for a 
+ * blacklisted URL, updating the corresponding counter if one is found. 
+ * Called by the reassembler (refer to reassembly.c).
  * 
- * @param http_packet HTTP packet to analyse
+ * @param arg Blacklist match of the calling thread
+ * @param key Flow on which the block was sent
+ * @param data Block of HTTP headers to search
+ * @param length Number of bytes in block
+ * @param reassembled Whether the block was built from multiple segments
  */
-void detect_blacklist_violation(const char* http_packet) {
+static void match_blacklist(void* arg, const struct flow_key* key, const unsigned char* data, 
+	size_t length, int reassembled) {
+
+	struct blacklist_match* match = (struct blacklist_match*) arg;
+	struct blacklist_state* blacklist = match->state;
 
 	// If HTTP request is of type GET
-	if (strstr(http_packet, "GET")) {
+	if (memmem(data, length, "GET", 3)) {
 
 		// Incremenet corresponding counter if blacklisted URL is found
-		if (strstr(http_packet, "www.google.co.uk")) {
-			attacks->google++;
-		} else if (strstr(http_packet, "www.facebook.com")) {
-			attacks->facebook++;
+		if (memmem(data, length, "www.google.co.uk", 16)) {
+			blacklist->google++;
+		} else if (memmem(data, length, "www.facebook.com", 16)) {
+			blacklist->facebook++;
+		} else {
+			return;
+		}
+		blacklist->reassembled += reassembled;
+		add_heavy_hitter(&blacklist->requesters, key->saddr, 1, 0);
+
+		// Only count towards the packet being analysed if sent on its flow
+		// (rather than flushed from another flow which timed out)
+		if (memcmp(key, match->key, sizeof(struct flow_key)) == 0) {
+			match->matches++;
 		}
 	}
 }
 
 
+/**
+ * @brief Passes the payload of a TCP packet sent to port 80 to the 
+ * reassembler, which calls match_blacklist with each complete block of HTTP 
+ * headers, so that requests split across segments are also searched.
+ * 
+ * @param state Blacklist detector state of the calling thread
+ * @param header Header of packet to analyse
+ * @param packet IP packet to analyse
+ * @return int Number of requests for blacklisted URLs found on the flow of
+ * the packet
+ */
+int detect_blacklist_violation(void* state, const struct pcap_pkthdr* header, const unsigned char* packet) {
+
+	struct blacklist_state* blacklist = (struct blacklist_state*) state;
+
+	// Parse TCP header and ensure destination port is 80
+	struct iphdr* ip_header = (struct iphdr*) packet;
+	struct tcphdr* tcp_header = parse_tcp_header(header, packet);
+	if (tcp_header == NULL || ntohs(tcp_header->dest) != 80) {
+		return 0;
+	}
+
+	// Find length of payload, excluding any ethernet padding
+	unsigned int offset = ETH_HLEN + (ip_header->ihl * 4) + (tcp_header->doff * 4);
+	if (header->caplen < offset) {
+		return 0;
+	}
+	size_t length = header->caplen - offset;
+	int ip_length = ntohs(ip_header->tot_len) - (ip_header->ihl * 4) - (tcp_header->doff * 4);
+	if (ip_length >= 0 && (size_t) ip_length < length) {
+		length = ip_length;
+	}
+	const unsigned char* http_packet = (unsigned char*) tcp_header + (tcp_header->doff * 4);
+
+	// Pass segment to reassembler
+	struct flow_key key = {
+		ip_header->saddr, ip_header->daddr, tcp_header->source, tcp_header->dest
+	};
+	int flags = (tcp_header->syn ? REASSEMBLY_SYN : 0) 
+		| (tcp_header->fin || tcp_header->rst ? REASSEMBLY_FIN : 0);
+	struct blacklist_match match = {blacklist, &key, 0};
+	enum reassembly_status status = reassemble_segment(&key, ntohl(tcp_header->seq), flags, 
+		http_packet, length, header->ts.tv_sec, match_blacklist, &match);
+
+	if (status == REASSEMBLY_DROPPED) {
+		blacklist->dropped++;
+	} else if (status == REASSEMBLY_EVICTED) {
+		blacklist->evicted++;
+	}
+
+	return match.matches;
+}
+
+
 /**
  * @brief Detects potential ARP cache poisoning attempts by 
  * parsing an ARP packet and checking for an ARP reply, incrementing
- * the global counter if one is found.
+ * the ARP counter if one is found.
  * 
+ * @param state ARP detector state of the calling thread
+ * @param header Header of packet to analyse
  * @param packet ARP packet to analyse
+ * @return int 1 if an ARP reply was detected, 0 otherwise
  */
-void detect_arp(const unsigned char* packet) {
+int detect_arp(void* state, const struct pcap_pkthdr* header, const unsigned char* packet) {
+
+	struct arp_state* arp = (struct arp_state*) state;
+
+	// Ensure ARP header has been captured
+	if (header->caplen < ETH_HLEN + sizeof(struct arphdr)) {
+		return 0;
+	}
 
 	// Parse ARP packet
 	struct ether_arp* arp_packet = (struct ether_arp*) packet;
@@ -131,24 +302,316 @@ void detect_arp(const unsigned char* packet) {
 	
 	// If opcode specifies an ARP reply (denoted by integer 2)
 	if (ntohs(arp_header->ar_op) == 2) {
-		attacks->arp_responses++;
+		arp->arp_responses++;
+		return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Displays the keys with the largest counts in a heavy hitter summary,
+ * each with the maximum amount by which its count may be overestimated.
+ * 
+ * @param title Description of keys
+ * @param hh Summary to display
+ * @param with_port Whether keys hold an IP address and port rather than
+ * only an IP address
+ */
+static void report_heavy_hitters(const char* title, const struct heavy_hitters* hh, int with_port) {
+
+	struct heavy_hitter top[HEAVY_HITTERS_TOP];
+	int count = top_heavy_hitters(hh, top, HEAVY_HITTERS_TOP);
+	if (count == 0) {
+		return;
+	}
+
+	printf("Top %s:\n", title);
+	for (int i = 0; i < count; i++) {
+		char address[INET_ADDRSTRLEN];
+		uint32_t ip_address = (uint32_t) (with_port ? top[i].key >> 16 : top[i].key);
+		inet_ntop(AF_INET, &ip_address, address, sizeof(address));
+
+		if (with_port) {
+			printf("\t%s:%d\t%ld (error at most %ld)\n", address, (int) (top[i].key & 0xffff), 
+				top[i].count, top[i].error);
+		} else {
+			printf("\t%s\t%ld (error at most %ld)\n", address, top[i].count, top[i].error);
+		}
+	}
+}
+
+
+/**
+ * @brief Allocates and initialises the state of the SYN detector.
+ * 
+ * @return void* Pointer to SYN detector state
+ */
+static void* init_syn_state() {
+	struct syn_state* syn = (struct syn_state*) malloc(sizeof(struct syn_state));
+	if (syn == NULL) {
+		fprintf(stderr, "Unable to allocate memory for SYN detector\n");
+		exit(1);
+	}
+	syn->syn_packets = 0;
+	initialise_array(&syn->ip_addresses);
+	initialise_heavy_hitters(&syn->sources);
+	initialise_heavy_hitters(&syn->targets);
+	return syn;
+}
+
+
+/**
+ * @brief Adds the SYN counter and source IP addresses of one SYN detector 
+ * state to another.
+ * 
+ * @param dst SYN detector state to update
+ * @param src SYN detector state to add
+ */
+static void merge_syn_state(void* dst, const void* src) {
+	struct syn_state* total = (struct syn_state*) dst;
+	const struct syn_state* syn = (const struct syn_state*) src;
+
+	total->syn_packets += syn->syn_packets;
+	merge_heavy_hitters(&total->sources, &syn->sources);
+	merge_heavy_hitters(&total->targets, &syn->targets);
+	for (size_t i = 0; i < syn->ip_addresses.size; i++) {
+		if (contains(&total->ip_addresses, syn->ip_addresses.array[i]) == 0) {
+			insert(&total->ip_addresses, syn->ip_addresses.array[i]);
+		}
+	}
+}
+
+
+/**
+ * @brief Displays the number of SYN packets and distinct source IPs detected.
+ * 
+ * @param state SYN detector state to display
+ */
+static void report_syn_state(const void* state) {
+	const struct syn_state* syn = (const struct syn_state*) state;
+	printf("%ld SYN packets detected from %ld different IPs (syn attack)\n", 
+		syn->syn_packets,
+		syn->ip_addresses.size
+	);
+	report_heavy_hitters("SYN sources", &syn->sources, 0);
+	report_heavy_hitters("SYN targets", &syn->targets, 1);
+}
+
+
+/**
+ * @brief Frees memory allocated to the state of the SYN detector.
+ * 
+ * @param state SYN detector state to free
+ */
+static void free_syn_state(void* state) {
+	struct syn_state* syn = (struct syn_state*) state;
+	free_array(&syn->ip_addresses);
+	free(syn);
+}
+
+
+/**
+ * @brief Writes the state of the SYN detector to a snapshot, followed by the
+ * source IP addresses it holds.
+ * 
+ * @param state SYN detector state to save
+ * @param file File to write state to
+ * @return size_t Number of bytes written, or 0 if a write failed
+ */
+static size_t save_syn_state(const void* state, FILE* file) {
+	const struct syn_state* syn = (const struct syn_state*) state;
+	size_t addresses = syn->ip_addresses.size;
+	if (fwrite(syn, sizeof(struct syn_state), 1, file) != 1
+		|| fwrite(syn->ip_addresses.array, sizeof(unsigned int), addresses, file) != addresses) {
+		return 0;
+	}
+	return sizeof(struct syn_state) + addresses * sizeof(unsigned int);
+}
+
+
+/**
+ * @brief Returns the SYN detector state saved in a snapshot, pointing its 
+ * array of source IP addresses at the addresses following it. The state is
+ * only merged into other states, so the array is never resized or freed.
+ * 
+ * @param data Saved state
+ * @param length Number of bytes of saved state
+ * @return void* Pointer to SYN detector state, or NULL if the state is invalid
+ */
+static void* restore_syn_state(void* data, size_t length) {
+	struct syn_state* syn = (struct syn_state*) data;
+	if (length < sizeof(struct syn_state) 
+		|| syn->ip_addresses.size != (length - sizeof(struct syn_state)) / sizeof(unsigned int)
+		|| (length - sizeof(struct syn_state)) % sizeof(unsigned int) != 0
+		|| valid_heavy_hitters(&syn->sources) == 0 || valid_heavy_hitters(&syn->targets) == 0) {
+		return NULL;
+	}
+	syn->ip_addresses.array = (unsigned int*) (syn + 1);
+	syn->ip_addresses.capacity = syn->ip_addresses.size;
+	return syn;
+}
+
+
+/**
+ * @brief Allocates and initialises the state of the ARP detector.
+ * 
+ * @return void* Pointer to ARP detector state
+ */
+static void* init_arp_state() {
+	struct arp_state* arp = (struct arp_state*) calloc(1, sizeof(struct arp_state));
+	if (arp == NULL) {
+		fprintf(stderr, "Unable to allocate memory for ARP detector\n");
+		exit(1);
+	}
+	return arp;
+}
+
+
+/**
+ * @brief Adds the counter of one ARP detector state to another.
+ * 
+ * @param dst ARP detector state to update
+ * @param src ARP detector state to add
+ */
+static void merge_arp_state(void* dst, const void* src) {
+	((struct arp_state*) dst)->arp_responses += ((const struct arp_state*) src)->arp_responses;
+}
+
+
+/**
+ * @brief Displays the number of ARP responses detected.
+ * 
+ * @param state ARP detector state to display
+ */
+static void report_arp_state(const void* state) {
+	printf("%ld ARP responses (cache poisoning)\n", 
+		((const struct arp_state*) state)->arp_responses
+	);
+}
+
+
+/**
+ * @brief Writes the state of the ARP detector to a snapshot.
+ * 
+ * @param state ARP detector state to save
+ * @param file File to write state to
+ * @return size_t Number of bytes written, or 0 if a write failed
+ */
+static size_t save_arp_state(const void* state, FILE* file) {
+	return fwrite(state, sizeof(struct arp_state), 1, file) * sizeof(struct arp_state);
+}
+
+
+/**
+ * @brief Returns the ARP detector state saved in a snapshot.
+ * 
+ * @param data Saved state
+ * @param length Number of bytes of saved state
+ * @return void* Pointer to ARP detector state, or NULL if length is invalid
+ */
+static void* restore_arp_state(void* data, size_t length) {
+	return (length == sizeof(struct arp_state)) ? data : NULL;
+}
+
+
+/**
+ * @brief Allocates and initialises the state of the URL blacklist detector.
+ * 
+ * @return void* Pointer to blacklist detector state
+ */
+static void* init_blacklist_state() {
+	struct blacklist_state* blacklist = (struct blacklist_state*) calloc(1, sizeof(struct blacklist_state));
+	if (blacklist == NULL) {
+		fprintf(stderr, "Unable to allocate memory for blacklist detector\n");
+		exit(1);
+	}
+	initialise_heavy_hitters(&blacklist->requesters);
+	return blacklist;
+}
+
+
+/**
+ * @brief Adds the counters of one blacklist detector state to another.
+ * 
+ * @param dst Blacklist detector state to update
+ * @param src Blacklist detector state to add
+ */
+static void merge_blacklist_state(void* dst, const void* src) {
+	struct blacklist_state* total = (struct blacklist_state*) dst;
+	const struct blacklist_state* blacklist = (const struct blacklist_state*) src;
+	total->google += blacklist->google;
+	total->facebook += blacklist->facebook;
+	total->reassembled += blacklist->reassembled;
+	total->dropped += blacklist->dropped;
+	total->evicted += blacklist->evicted;
+	merge_heavy_hitters(&total->requesters, &blacklist->requesters);
+}
+
+
+/**
+ * @brief Displays the number of blacklist violations detected.
+ * 
+ * @param state Blacklist detector state to display
+ */
+static void report_blacklist_state(const void* state) {
+	const struct blacklist_state* blacklist = (const struct blacklist_state*) state;
+	printf("%ld Blacklist violations (%ld google and %ld facebook)\n",
+		blacklist->google + blacklist->facebook,
+		blacklist->google,
+		blacklist->facebook
+	);
+	printf("%ld Blacklist violations split across segments (%ld segments dropped, %ld flows evicted)\n",
+		blacklist->reassembled,
+		blacklist->dropped,
+		blacklist->evicted
+	);
+	report_heavy_hitters("blacklist requesters", &blacklist->requesters, 0);
+}
+
+
+/**
+ * @brief Writes the state of the blacklist detector to a snapshot.
+ * 
+ * @param state Blacklist detector state to save
+ * @param file File to write state to
+ * @return size_t Number of bytes written, or 0 if a write failed
+ */
+static size_t save_blacklist_state(const void* state, FILE* file) {
+	return fwrite(state, sizeof(struct blacklist_state), 1, file) * sizeof(struct blacklist_state);
+}
+
+
+/**
+ * @brief Returns the blacklist detector state saved in a snapshot.
+ * 
+ * @param data Saved state
+ * @param length Number of bytes of saved state
+ * @return void* Pointer to blacklist detector state, or NULL if the state is invalid
+ */
+static void* restore_blacklist_state(void* data, size_t length) {
+	struct blacklist_state* blacklist = (struct blacklist_state*) data;
+	if (length != sizeof(struct blacklist_state) || valid_heavy_hitters(&blacklist->requesters) == 0) {
+		return NULL;
 	}
+	return blacklist;
 }
 
 
 /**
  * @brief Utility/debugging method for printing raw packet data.
  * 
+ * @param number Number of packet displayed in its heading
  * @param data Raw packet data to dump
  * @param length Length of packet header
  */
-void dump(const unsigned char* data, int length) {
+void dump(unsigned long number, const unsigned char* data, int length) {
 	
 	unsigned int i;
 
 	// Decode Packet Header
 	struct ether_header* eth_header = (struct ether_header*) data;
-	printf("\n\n === PACKET %ld HEADER ===", packet_count);
+	printf("\n\n === PACKET %ld HEADER ===", number);
 	printf("\nSource MAC: ");
 	
 	for (i = 0; i < 6; ++i) {
@@ -167,7 +630,7 @@ void dump(const unsigned char* data, int length) {
 	}
 
 	printf("\nType: %hu\n", eth_header->ether_type);
-	printf(" === PACKET %ld DATA == \n", packet_count);
+	printf(" === PACKET %ld DATA == \n", number);
 	
 	// Decode Packet Data (Skipping over the header)
 	int data_bytes = length - ETH_HLEN;
@@ -203,5 +666,4 @@ void dump(const unsigned char* data, int length) {
 		payload += output_bytes;
 		data_bytes -= output_bytes;
 	}
-	packet_count++;
 }
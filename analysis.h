@@ -1,19 +1,57 @@
 #ifndef CS241_ANALYSIS_H
 #define CS241_ANALYSIS_H
 
-#include "analysis.h"
-#include "sniff.h"
+#include "detector.h"
+#include "dynamic_array.h"
+#include "heavy_hitters.h"
+#include "reassembly.h"
 
 #include <pcap.h>
 
 // Number of bytes in header
-#define ETH_HLEN 14;
+#define ETH_HLEN 14
+
+// Struct storing the state of the SYN detector
+struct syn_state {
+    unsigned long syn_packets;
+    struct dynamic_array ip_addresses;
+    struct heavy_hitters sources;
+    struct heavy_hitters targets;
+};
+
+// Struct storing the state of the ARP detector
+struct arp_state {
+    unsigned long arp_responses;
+};
+
+// Struct storing the state of the URL blacklist detector
+struct blacklist_state {
+    unsigned long google;
+    unsigned long facebook;
+    unsigned long reassembled;
+    unsigned long dropped;
+    unsigned long evicted;
+    struct heavy_hitters requesters;
+};
+
+// Struct passed to the reassembler when searching for blacklist violations,
+// counting those found on the flow of the packet being analysed
+struct blacklist_match {
+    struct blacklist_state* state;
+    const struct flow_key* key;
+    int matches;
+};
+
+// Detectors built into the analyser
+extern const struct detector syn_detector;
+extern const struct detector arp_detector;
+extern const struct detector blacklist_detector;
 
 // Function prototypes
-void analyse(const struct pcap_pkthdr* header, const unsigned char* packet);
-void detect_syn(const unsigned char* packet);
-void detect_blacklist_violation(const char* http_packet);
-void detect_arp(const unsigned char* packet);
-void dump(const unsigned char* data, int length);
+void analyse(struct detector_context* context, const struct pcap_pkthdr* header, const unsigned char* packet);
+int detect_syn(void* state, const struct pcap_pkthdr* header, const unsigned char* packet);
+int detect_blacklist_violation(void* state, const struct pcap_pkthdr* header, const unsigned char* packet);
+int detect_arp(void* state, const struct pcap_pkthdr* header, const unsigned char* packet);
+void dump(unsigned long number, const unsigned char* data, int length);
 
 #endif
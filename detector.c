@@ -0,0 +1,695 @@
+#include "detector.h"
+#include "analysis.h"
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <pcap.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+
+// Registry of available detectors, filled in before main runs by the
+// constructor of each file defining detectors (refer to analysis.c)
+static const struct detector* registry[MAX_DETECTORS];
+static int registry_size = 0;
+
+// Detectors selected at startup, in the order their reports are displayed
+static const struct detector* enabled[MAX_DETECTORS];
+static int enabled_count = 0;
+
+// Dispatch tables mapping ethernet types and IP protocols to enabled detectors
+static struct {
+    unsigned short type;
+    struct dispatch_list list;
+} ethertype_table[MAX_ETHERTYPES];
+static int ethertype_count = 0;
+static struct dispatch_list ip_protocol_table[256];
+
+// States restored from a snapshot, which are added to the states of the 
+// threads whenever they are reported or saved
+static void* baseline[MAX_DETECTORS];
+
+// Records restored from a snapshot for detectors which are not saved by this
+// run, which are copied unchanged into every snapshot written
+static const struct snapshot_record* kept_records[MAX_DETECTORS];
+static int kept_count = 0;
+
+// Contexts of every thread, read when evaluating thresholds
+static struct detector_context* contexts[MAX_CONTEXTS];
+static int context_count = 0;
+
+// Thresholds on the number of detections made by a detector within a window
+// of seconds, with the last second of capture time up to which they have been
+// evaluated
+static struct {
+    const struct detector* detector;
+    int index;
+    unsigned long count;
+    int window;
+    int alerting;
+    unsigned long alerts;
+} thresholds[MAX_THRESHOLDS];
+static int threshold_count = 0;
+static long last_evaluated = 0;
+
+
+/**
+ * @brief Adds a detector to the registry so that it can be selected at
+ * startup. Must be called before select_detectors, which is done by calling
+ * it from a function marked __attribute__((constructor)) in the file defining
+ * the detector.
+ *
+ * @param detector Pointer to detector to register
+ * @return int 0 if the detector was registered, -1 if the registry is full
+ */
+int register_detector(const struct detector* detector) {
+    if (registry_size == MAX_DETECTORS) {
+        fprintf(stderr, "Unable to register detector %s\n", detector->name);
+        return -1;
+    }
+    registry[registry_size++] = detector;
+    return 0;
+}
+
+
+/**
+ * @brief Appends the detector at a given index of the enabled list to a
+ * dispatch list.
+ *
+ * @param list Pointer to dispatch list to update
+ * @param index Index of detector in the enabled list
+ */
+static void add_to_list(struct dispatch_list* list, int index) {
+    list->indices[list->size++] = (unsigned char) index;
+}
+
+
+/**
+ * @brief Builds the ethernet type and IP protocol dispatch tables from the
+ * enabled detectors, so that each packet is only passed to the detectors
+ * attached to its type.
+ *
+ * @return int 0 on success, -1 if too many ethernet types are used
+ */
+static int build_dispatch_tables() {
+
+    for (int i = 0; i < enabled_count; i++) {
+        const struct detector* detector = enabled[i];
+
+        if (detector->layer == LAYER_IP) {
+            add_to_list(&ip_protocol_table[detector->type & 0xff], i);
+            continue;
+        }
+
+        // Find existing entry for ethernet type, creating one if necessary
+        int entry = 0;
+        while (entry < ethertype_count && ethertype_table[entry].type != detector->type) {
+            entry++;
+        }
+        if (entry == ethertype_count) {
+            if (ethertype_count == MAX_ETHERTYPES) {
+                fprintf(stderr, "Unable to attach detector %s\n", detector->name);
+                return -1;
+            }
+            ethertype_table[ethertype_count++].type = detector->type;
+        }
+        add_to_list(&ethertype_table[entry].list, i);
+    }
+
+    // Attach thresholds to enabled detectors
+    for (int i = 0; i < threshold_count; i++) {
+        thresholds[i].index = -1;
+        for (int j = 0; j < enabled_count; j++) {
+            if (enabled[j] == thresholds[i].detector) {
+                thresholds[i].index = j;
+            }
+        }
+        if (thresholds[i].index == -1) {
+            fprintf(stderr, "Ignoring threshold for disabled detector %s\n", thresholds[i].detector->name);
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Enables the registered detectors named in a comma separated list
+ * (or every registered detector if the list is NULL or "all") and builds
+ * the dispatch tables used to analyse packets.
+ *
+ * @param names Comma separated list of detector names
+ * @return int 0 on success, -1 if a name does not match a registered detector
+ */
+int select_detectors(const char* names) {
+
+    if (names == NULL || strcmp(names, "all") == 0) {
+        for (int i = 0; i < registry_size; i++) {
+            enabled[enabled_count++] = registry[i];
+        }
+        return build_dispatch_tables();
+    }
+
+    char* list = strdup(names);
+    if (list == NULL) {
+        fprintf(stderr, "Unable to allocate memory for detector list\n");
+        exit(1);
+    }
+
+    char* saveptr = NULL;
+    for (char* name = strtok_r(list, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+
+        // Find detector with matching name in registry
+        const struct detector* detector = NULL;
+        for (int i = 0; i < registry_size; i++) {
+            if (strcmp(registry[i]->name, name) == 0) {
+                detector = registry[i];
+            }
+        }
+        if (detector == NULL) {
+            fprintf(stderr, "Unknown detector %s\n", name);
+            free(list);
+            return -1;
+        }
+
+        // Ignore detectors which have already been enabled
+        int duplicate = 0;
+        for (int i = 0; i < enabled_count; i++) {
+            duplicate |= (enabled[i] == detector);
+        }
+        if (duplicate == 0) {
+            enabled[enabled_count++] = detector;
+        }
+    }
+
+    free(list);
+    return build_dispatch_tables();
+}
+
+
+/**
+ * @brief Adds a threshold on the rate of detections made by a registered 
+ * detector, given as name=count/seconds, which raises an alert whenever the
+ * detector makes at least count detections within a sliding window of the
+ * given number of seconds. Must be called before select_detectors.
+ *
+ * @param spec Threshold specification
+ * @return int 0 on success, -1 if the specification is invalid
+ */
+int add_threshold(const char* spec) {
+
+    char name[64];
+    unsigned long count;
+    int window;
+    if (sscanf(spec, "%63[^=]=%lu/%d", name, &count, &window) != 3
+        || window < 1 || window >= RATE_SLOTS || threshold_count == MAX_THRESHOLDS) {
+        fprintf(stderr, "Invalid threshold %s\n", spec);
+        return -1;
+    }
+
+    // Find detector with matching name in registry
+    for (int i = 0; i < registry_size; i++) {
+        if (strcmp(registry[i]->name, name) == 0) {
+            thresholds[threshold_count].detector = registry[i];
+            thresholds[threshold_count].count = count;
+            thresholds[threshold_count].window = window;
+            threshold_count++;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown detector %s\n", name);
+    return -1;
+}
+
+
+/**
+ * @brief Calls the setup hook of each enabled detector which has one.
+ *
+ */
+void setup_detectors() {
+    for (int i = 0; i < enabled_count; i++) {
+        if (enabled[i]->setup != NULL) {
+            enabled[i]->setup();
+        }
+    }
+}
+
+
+/**
+ * @brief Calls the cleanup hook of each enabled detector which has one.
+ *
+ */
+void cleanup_detectors() {
+    for (int i = 0; i < enabled_count; i++) {
+        if (enabled[i]->cleanup != NULL) {
+            enabled[i]->cleanup();
+        }
+    }
+}
+
+
+/**
+ * @brief Returns a pointer to a detector context after allocating memory for
+ * it and initialising the state of each enabled detector.
+ *
+ * @return struct detector_context* Pointer to detector context
+ */
+struct detector_context* initialise_detector_context() {
+
+    // Allocate memory for context
+    struct detector_context* context = (struct detector_context*) calloc(1, sizeof(struct detector_context));
+    if (context == NULL) {
+        fprintf(stderr, "Unable to allocate memory for detector context\n");
+        exit(1);
+    }
+
+    // Initialise state and detection rates of each enabled detector
+    pthread_mutex_init(&context->lock, NULL);
+    for (int i = 0; i < enabled_count; i++) {
+        context->states[i] = enabled[i]->init();
+        for (int j = 0; j < RATE_SLOTS; j++) {
+            context->rates[i].slots[j].second = -1;
+        }
+    }
+
+    // Keep track of context so that its detection rates can be read
+    if (context_count == MAX_CONTEXTS) {
+        fprintf(stderr, "Unable to track detection rates of context\n");
+        exit(1);
+    }
+    contexts[context_count++] = context;
+
+    return context;
+}
+
+
+/**
+ * @brief Frees memory allocated to the state of each enabled detector as
+ * well as the context itself.
+ *
+ * @param context Pointer to detector context to free
+ */
+void free_detector_context(struct detector_context* context) {
+    for (int i = 0; i < enabled_count; i++) {
+        enabled[i]->free(context->states[i]);
+    }
+    pthread_mutex_destroy(&context->lock);
+    free(context);
+}
+
+
+/**
+ * @brief Adds a number of detections made in a given second to a ring of 
+ * per-second counts, resetting the slot if it holds an earlier second. Must 
+ * only be called by the thread owning the ring.
+ */
+static void count_detections(struct rate_counter* rates, long second, int detections) {
+    struct rate_slot* slot = &rates->slots[(unsigned long) second % RATE_SLOTS];
+    if (slot->second != second) {
+        __atomic_store_n(&slot->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->second, second, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&slot->count, slot->count + detections, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * @brief Returns the number of detections made within the seconds 
+ * [first, last] according to a ring of per-second counts. Slots which are 
+ * reset while being read are treated as empty.
+ */
+static unsigned long sum_detections(const struct rate_counter* rates, long first, long last) {
+    unsigned long total = 0;
+    for (long second = first; second <= last; second++) {
+        const struct rate_slot* slot = &rates->slots[(unsigned long) second % RATE_SLOTS];
+        if (__atomic_load_n(&slot->second, __ATOMIC_ACQUIRE) != second) {
+            continue;
+        }
+        unsigned long count = __atomic_load_n(&slot->count, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->second, __ATOMIC_ACQUIRE) == second) {
+            total += count;
+        }
+    }
+    return total;
+}
+
+
+/**
+ * @brief Evaluates each threshold over the window ending with a given second
+ * of capture time. Displays an alert (with the capture time following the 
+ * window) when a threshold is first exceeded, and when the rate falls below 
+ * it again.
+ *
+ * @param last Last second of window
+ */
+static void evaluate_second(long last) {
+
+    char timestamp[32];
+    struct tm time;
+    time_t seconds = (time_t) (last + 1);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &time));
+
+    for (int i = 0; i < threshold_count; i++) {
+        if (thresholds[i].index == -1) {
+            continue;
+        }
+
+        // Sum detections within window across every thread
+        unsigned long total = 0;
+        for (int j = 0; j < context_count; j++) {
+            total += sum_detections(&contexts[j]->rates[thresholds[i].index], 
+                last + 1 - thresholds[i].window, last);
+        }
+
+        if (total >= thresholds[i].count && thresholds[i].alerting == 0) {
+            thresholds[i].alerting = 1;
+            thresholds[i].alerts++;
+            printf("ALERT %s: %ld %s detections in last %d s (threshold %ld)\n", timestamp, 
+                total, thresholds[i].detector->name, thresholds[i].window, thresholds[i].count);
+        } else if (total < thresholds[i].count && thresholds[i].alerting == 1) {
+            thresholds[i].alerting = 0;
+            printf("CLEARED %s: %ld %s detections in last %d s (threshold %ld)\n", timestamp, 
+                total, thresholds[i].detector->name, thresholds[i].window, thresholds[i].count);
+        }
+    }
+}
+
+
+/**
+ * @brief Evaluates each threshold over the window ending with every second of
+ * capture time up to a given second which has not been evaluated yet. Must 
+ * only be called by a single thread, once every packet captured up to the end
+ * of the given second has been analysed, so that windows are never evaluated
+ * before all of their detections have been counted.
+ *
+ * @param last Last second of capture time to evaluate
+ */
+static void evaluate_thresholds(long last) {
+
+    if (threshold_count == 0 || last <= last_evaluated) {
+        return;
+    }
+
+    // Skip seconds no longer held by the rings of detection counts (which
+    // include every second before capture started)
+    if (last - last_evaluated >= RATE_SLOTS) {
+        last_evaluated = last - RATE_SLOTS;
+    }
+    for (long second = last_evaluated + 1; second <= last; second++) {
+        evaluate_second(second);
+    }
+    last_evaluated = last;
+}
+
+
+/**
+ * @brief Passes the last second of capture time analysed by every thread to
+ * the advance hook of each enabled detector which has one, then evaluates
+ * thresholds up to it. Must only be called by the capture thread.
+ *
+ * @param last Last second of capture time analysed by every thread
+ */
+void advance_detectors(long last) {
+    for (int i = 0; i < enabled_count; i++) {
+        if (enabled[i]->advance != NULL) {
+            enabled[i]->advance(last);
+        }
+    }
+    evaluate_thresholds(last);
+}
+
+
+/**
+ * @brief Passes a packet (stripped of its ethernet header) to each detector
+ * in a given dispatch list, counting its detections in the current second.
+ *
+ * @return int Number of detections reported by the detectors
+ */
+static int run_list(struct detector_context* context, const struct dispatch_list* list,
+    const struct pcap_pkthdr* header, const unsigned char* packet) {
+
+    int detections = 0;
+    for (int i = 0; i < list->size; i++) {
+        int index = list->indices[i];
+        int found = enabled[index]->process(context->states[index], header, packet);
+        if (found > 0) {
+            count_detections(&context->rates[index], header->ts.tv_sec, found);
+            detections += found;
+        }
+    }
+    return detections;
+}
+
+
+/**
+ * @brief Passes a packet to the detectors attached to its ethernet type and,
+ * for IPv4 packets, to those attached to its IP protocol.
+ *
+ * @param context Detector context of the calling thread
+ * @param header Header of packet to analyse
+ * @param packet Remainder of packet to analyse
+ * @return int Number of detections reported by the detectors
+ */
+int run_detectors(struct detector_context* context, const struct pcap_pkthdr* header, const unsigned char* packet) {
+
+    // Ensure ethernet header has been captured
+    if (header->caplen < ETH_HLEN) {
+        return 0;
+    }
+
+    struct ether_header* ether_header = (struct ether_header*) packet;
+    unsigned short ethernet_type = ntohs(ether_header->ether_type);
+    const unsigned char* payload = packet + ETH_HLEN;
+    int detections = 0;
+
+    // Run detectors attached to ethernet type
+    for (int i = 0; i < ethertype_count; i++) {
+        if (ethertype_table[i].type == ethernet_type) {
+            detections += run_list(context, &ethertype_table[i].list, header, payload);
+            break;
+        }
+    }
+
+    // Run detectors attached to IP protocol
+    if (ethernet_type == ETHERTYPE_IP && header->caplen >= ETH_HLEN + sizeof(struct iphdr)) {
+        struct iphdr* ip_header = (struct iphdr*) payload;
+        detections += run_list(context, &ip_protocol_table[ip_header->protocol], header, payload);
+    }
+
+    return detections;
+}
+
+
+/**
+ * @brief Merges the state of each enabled detector across a given set of
+ * contexts (and any state restored from a snapshot) and displays the report 
+ * of each detector.
+ *
+ * @param contexts Array of detector contexts to merge
+ * @param count Number of contexts in array
+ */
+void report_detectors(struct detector_context** contexts, int count) {
+    for (int i = 0; i < enabled_count; i++) {
+        void* total = enabled[i]->init();
+        if (baseline[i] != NULL) {
+            enabled[i]->merge(total, baseline[i]);
+        }
+        for (int j = 0; j < count; j++) {
+            enabled[i]->merge(total, contexts[j]->states[i]);
+        }
+        enabled[i]->report(total);
+        enabled[i]->free(total);
+    }
+}
+
+
+/**
+ * @brief Returns whether the state of a given detector is written to snapshots,
+ * which requires it to be enabled and to have save and restore hooks.
+ */
+static int is_saved(const char* name) {
+    for (int i = 0; i < enabled_count; i++) {
+        if (strcmp(enabled[i]->name, name) == 0) {
+            return enabled[i]->save != NULL && enabled[i]->restore != NULL;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Pads a record of a given length so that the next record is aligned.
+ *
+ * @return int 0 on success, -1 if the write failed
+ */
+static int write_padding(FILE* file, size_t length) {
+    static const unsigned char padding[SNAPSHOT_ALIGNMENT] = {0};
+    size_t padded = SNAPSHOT_ALIGN(length);
+    return (fwrite(padding, 1, padded - length, file) == padded - length) ? 0 : -1;
+}
+
+
+/**
+ * @brief Writes a snapshot record for each enabled detector with save and 
+ * restore hooks, holding its state merged across a given set of contexts (and
+ * any state restored from a snapshot). The lock of each context is only held
+ * while its state is copied to memory with the save hook, and the copy is 
+ * restored and merged once the lock has been released, so that threads are
+ * not blocked while states are merged or the record is written. Records
+ * restored for other detectors are then copied unchanged, so that their state
+ * survives runs in which they are not enabled.
+ *
+ * @param file File to write records to
+ * @param contexts Array of detector contexts to merge
+ * @param count Number of contexts in array
+ * @return int Number of records written, or -1 if a write failed
+ */
+int save_detectors(FILE* file, struct detector_context** contexts, int count) {
+
+    char* copy = NULL;
+    size_t copy_size = 0;
+    FILE* stream = open_memstream(&copy, &copy_size);
+    if (stream == NULL) {
+        return -1;
+    }
+
+    int records = 0;
+    for (int i = 0; i < enabled_count && records >= 0; i++) {
+        if (enabled[i]->save == NULL || enabled[i]->restore == NULL) {
+            continue;
+        }
+
+        // Copy state of each thread into a single state
+        void* total = enabled[i]->init();
+        if (baseline[i] != NULL) {
+            enabled[i]->merge(total, baseline[i]);
+        }
+        for (int j = 0; j < count && records >= 0; j++) {
+            rewind(stream);
+            pthread_mutex_lock(&contexts[j]->lock);
+            size_t length = enabled[i]->save(contexts[j]->states[i], stream);
+            pthread_mutex_unlock(&contexts[j]->lock);
+
+            void* state = NULL;
+            if (length > 0 && fflush(stream) == 0) {
+                state = enabled[i]->restore(copy, length);
+            }
+            if (state == NULL) {
+                records = -1;
+            } else {
+                enabled[i]->merge(total, state);
+            }
+        }
+        if (records < 0) {
+            enabled[i]->free(total);
+            break;
+        }
+
+        // Write record header, then state, then fill in length of state
+        struct snapshot_record record = {0};
+        strncpy(record.name, enabled[i]->name, sizeof(record.name) - 1);
+        long start = ftell(file);
+        int failed = (fwrite(&record, sizeof(record), 1, file) != 1);
+        if (failed == 0) {
+            record.length = enabled[i]->save(total, file);
+            failed = (record.length == 0);
+        }
+        enabled[i]->free(total);
+
+        // Pad state so that the next record is aligned
+        if (failed == 1 || write_padding(file, record.length) != 0
+            || fseek(file, start, SEEK_SET) != 0 || fwrite(&record, sizeof(record), 1, file) != 1
+            || fseek(file, 0, SEEK_END) != 0) {
+            records = -1;
+            break;
+        }
+        records++;
+    }
+
+    // Copy records kept from the restored snapshot
+    for (int i = 0; i < kept_count && records >= 0; i++) {
+        const struct snapshot_record* record = kept_records[i];
+        if (fwrite(record, sizeof(struct snapshot_record), 1, file) != 1
+            || fwrite(record + 1, 1, record->length, file) != record->length
+            || write_padding(file, record->length) != 0) {
+            records = -1;
+        } else {
+            records++;
+        }
+    }
+
+    fclose(stream);
+    free(copy);
+    return records;
+}
+
+
+/**
+ * @brief Restores the state of each enabled detector from the records of a
+ * snapshot, using each saved state in place rather than copying it. Records
+ * of detectors which are not saved by this run (as they are not enabled or
+ * have no save or restore hook) are kept to be copied into later snapshots,
+ * while any records following a truncated record are skipped. The data must
+ * remain mapped until the program exits.
+ *
+ * @param data Records of the snapshot
+ * @param length Number of bytes of records
+ * @return int Number of states restored
+ */
+int restore_detectors(unsigned char* data, size_t length) {
+
+    int restored = 0;
+    size_t offset = 0;
+    while (offset < length) {
+        struct snapshot_record* record = (struct snapshot_record*) (data + offset);
+        if (length - offset < sizeof(struct snapshot_record) 
+            || record->length > length - offset - sizeof(struct snapshot_record)) {
+            fprintf(stderr, "Ignoring truncated snapshot records\n");
+            break;
+        }
+        offset += sizeof(struct snapshot_record);
+
+        // Keep record of detector not saved by this run
+        record->name[sizeof(record->name) - 1] = '\0';
+        if (is_saved(record->name) == 0) {
+            if (kept_count < MAX_DETECTORS) {
+                kept_records[kept_count++] = record;
+            } else {
+                fprintf(stderr, "Ignoring snapshot of detector %s\n", record->name);
+            }
+        }
+
+        // Find enabled detector with matching name
+        for (int i = 0; i < enabled_count; i++) {
+            if (strcmp(enabled[i]->name, record->name) != 0 || enabled[i]->restore == NULL) {
+                continue;
+            }
+            baseline[i] = enabled[i]->restore(data + offset, record->length);
+            if (baseline[i] == NULL) {
+                fprintf(stderr, "Ignoring invalid snapshot of detector %s\n", record->name);
+            } else {
+                restored++;
+            }
+        }
+        offset += SNAPSHOT_ALIGN(record->length);
+    }
+    return restored;
+}
+
+
+/**
+ * @brief Displays the number of alerts raised for each threshold.
+ *
+ */
+void report_thresholds() {
+    for (int i = 0; i < threshold_count; i++) {
+        printf("%ld alerts for %s (threshold %ld in %d s)\n",
+            thresholds[i].alerts,
+            thresholds[i].detector->name,
+            thresholds[i].count,
+            thresholds[i].window
+        );
+    }
+}
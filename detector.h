@@ -0,0 +1,96 @@
+#ifndef CS241_DETECTOR_H
+#define CS241_DETECTOR_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <pcap.h>
+
+#define MAX_DETECTORS 16
+#define MAX_ETHERTYPES 8
+#define MAX_CONTEXTS 64
+#define MAX_THRESHOLDS 16
+
+// Number of seconds of detection counts kept per detector, which bounds the
+// length of threshold windows
+#define RATE_SLOTS 64
+
+// Layer at which a detector is attached to the dispatch tables
+enum detector_layer {
+    LAYER_ETHERNET,  // Matched on the ethernet type of the frame
+    LAYER_IP         // Matched on the protocol field of an IPv4 header
+};
+
+// Struct describing a detector and the hooks used to drive it. Each worker
+// thread owns a separate state created by init, which is passed to process
+// for every matching packet and combined into a single state by merge before
+// being displayed by report. The optional setup and cleanup hooks manage any
+// resources shared by all threads, the optional advance hook is called with
+// each second of capture time once every thread has analysed it, and the
+// optional save and restore hooks
+// write a state to a snapshot and use a saved state in place (returning NULL
+// if it does not match the layout of the state). Detectors are added to the
+// registry by calling register_detector from a constructor in the file
+// defining them.
+struct detector {
+    const char* name;
+    enum detector_layer layer;
+    unsigned short type;
+    void (*setup)(void);
+    void (*cleanup)(void);
+    void (*advance)(long second);
+    void* (*init)(void);
+    int (*process)(void* state, const struct pcap_pkthdr* header, const unsigned char* packet);
+    void (*merge)(void* dst, const void* src);
+    void (*report)(const void* state);
+    void (*free)(void* state);
+    size_t (*save)(const void* state, FILE* file);
+    void* (*restore)(void* data, size_t length);
+};
+
+// Struct storing the number of detections made in a given second of capture time
+struct rate_slot {
+    long second;
+    unsigned long count;
+};
+
+// Struct representing a ring of per-second detection counts, written only by
+// the thread owning it and read without locks when thresholds are evaluated
+struct rate_counter {
+    struct rate_slot slots[RATE_SLOTS];
+};
+
+// Struct storing the state and detection rates of each enabled detector for 
+// a single thread, the number of packets analysed by the thread and the 
+// capture time (in seconds) of the last of them. The lock
+// is held by the thread while analysing a batch, and while its states are
+// copied to a snapshot.
+struct detector_context {
+    void* states[MAX_DETECTORS];
+    struct rate_counter rates[MAX_DETECTORS];
+    unsigned long packets;
+    long second;
+    pthread_mutex_t lock;
+};
+
+// Struct storing the indices of the enabled detectors matching a given type
+struct dispatch_list {
+    unsigned char size;
+    unsigned char indices[MAX_DETECTORS];
+};
+
+// Function prototypes
+int register_detector(const struct detector* detector);
+int select_detectors(const char* names);
+int add_threshold(const char* spec);
+void setup_detectors();
+void cleanup_detectors();
+struct detector_context* initialise_detector_context();
+void free_detector_context(struct detector_context* context);
+int run_detectors(struct detector_context* context, const struct pcap_pkthdr* header, const unsigned char* packet);
+void report_detectors(struct detector_context** contexts, int count);
+int save_detectors(FILE* file, struct detector_context** contexts, int count);
+int restore_detectors(unsigned char* data, size_t length);
+void advance_detectors(long last);
+void report_thresholds();
+
+#endif
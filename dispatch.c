@@ -1,31 +1,89 @@
 #include "sniff.h"
 #include "dispatch.h"
 #include "analysis.h"
-#include "dynamic_array.h"
+#include "detector.h"
 #include "queue.h"
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <pcap.h>
 #include <pthread.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
 
 
-// Threadpool and request queue declarations
+// Threadpool, detector contexts and request queue declarations, with a queue
+// for each thread so that every packet of a flow is analysed by one thread
 pthread_t threadpool[THREADPOOL_SIZE];
-struct queue* request_queue;
+struct detector_context* worker_contexts[THREADPOOL_SIZE];
+struct queue* request_queues[THREADPOOL_SIZE];
 
-// Initialisations of mutex locks and condition variable for queue
-pthread_mutex_t main_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Initialisations of mutex lock for the queues and condition variable for
+// each queue
 pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond_var = PTHREAD_COND_INITIALIZER;
+pthread_cond_t cond_vars[THREADPOOL_SIZE];
+
+// Shutdown flag and deadline for draining the queues (guarded by queue_mutex),
+// and number of packets left in the queues when the deadline passed
+static int draining = 0;
+static int has_deadline = 0;
+static struct timespec drain_deadline;
+unsigned long abandoned_count = 0;
+
+// Batch of packets being filled by the capture thread for each thread, the
+// time at which each was started, and number of batches added to the queues
+static struct packet_batch* current_batches[THREADPOOL_SIZE];
+static struct timespec batch_started[THREADPOOL_SIZE];
+unsigned long batch_count = 0;
+
+// Number of packets handed to each thread, and capture time (in seconds) of
+// the last packet captured
+static unsigned long dispatched[THREADPOOL_SIZE];
+static long dispatched_second = 0;
 
 
 /**
- * @brief Callback function provided to pcap_loop (refer to sniff.c). Copies new
+ * @brief Returns the index of the thread which analyses a given packet. IPv4
+ * packets are assigned by hashing their addresses and (for TCP and UDP) ports,
+ * symmetrically so that both directions of a flow share a thread, which then
+ * sees the segments of the flow in capture order. Other packets are spread 
+ * across the threads in turn.
+ *
+ * @param header Header of packet
+ * @param packet Packet to assign
+ * @return int Index of thread
+ */
+static int select_worker(const struct pcap_pkthdr* header, const unsigned char* packet) {
+
+    if (header->caplen < ETH_HLEN + sizeof(struct iphdr)
+        || ntohs(((const struct ether_header*) packet)->ether_type) != ETHERTYPE_IP) {
+        return (int) (packet_count % THREADPOOL_SIZE);
+    }
+
+    const struct iphdr* ip_header = (const struct iphdr*) (packet + ETH_HLEN);
+    uint32_t hash = (ip_header->saddr ^ ip_header->daddr) * 0x9e3779b1u;
+
+    // Ports are the first 4 bytes of both TCP and UDP headers
+    unsigned int offset = ETH_HLEN + ip_header->ihl * 4;
+    if ((ip_header->protocol == IPPROTO_TCP || ip_header->protocol == IPPROTO_UDP)
+        && header->caplen >= offset + 4) {
+        const uint16_t* ports = (const uint16_t*) (packet + offset);
+        hash ^= (uint32_t) (ports[0] ^ ports[1]) * 0x85ebca6bu;
+    }
+    hash ^= hash >> 16;
+    return (int) (hash % THREADPOOL_SIZE);
+}
+
+
+/**
+ * @brief Callback function provided to pcap_dispatch (refer to sniff.c). Copies new
  * packets to the heap to prevent memory from being overwritten, then inserts packet 
- * data into separate struct to be added to the request queue for processing by threads.
+ * data into the current batch of the thread assigned to the packet, which is added
+ * to the request queue of the thread once it holds settings.batch_size packets.
  * 
- * @param args user arguments provided to pcap_loop
+ * @param args user arguments provided to pcap_dispatch
  * @param header Header of new packet
  * @param packet Remainder of new packet
  */
@@ -34,104 +92,299 @@ void dispatch(u_char* args, const struct pcap_pkthdr* header, const u_char* pack
     // Increment global counter for the number of packets sniffed
     packet_count++;
 
-    // Allocate memory to copy packet data to heap
-    unsigned char* packet_data = malloc((header->len + 1) * sizeof(char));
+    // Allocate memory to copy captured packet data to heap
+    unsigned char* packet_data = malloc((header->caplen + 1) * sizeof(char));
     if (packet_data == NULL) {
         fprintf(stderr, "Unable to copy data of new packet to heap\n");
         exit(1);
     }
 
     // Copy packet data to heap
-    memcpy(packet_data, packet, header->len);
-    packet_data[(header->len) * sizeof(char)] = '\0';
+    memcpy(packet_data, packet, header->caplen);
+    packet_data[(header->caplen) * sizeof(char)] = '\0';
    
-    // Allocate memory to insert new packet and header into a separate struct
-    struct packet* pckt = (struct packet*) malloc(sizeof(struct packet));
-    if (pckt == NULL) {
-        fprintf(stderr, "Unable to allocate memory for new packet\n");
-        exit(1);
+    // Allocate memory for a new batch if the previous one has been queued
+    int worker = select_worker(header, packet);
+    struct packet_batch* batch = current_batches[worker];
+    if (batch == NULL) {
+        batch = (struct packet_batch*) malloc(sizeof(struct packet_batch) 
+            + settings.batch_size * sizeof(struct packet));
+        if (batch == NULL) {
+            fprintf(stderr, "Unable to allocate memory for new batch\n");
+            exit(1);
+        }
+        batch->size = 0;
+        current_batches[worker] = batch;
+        clock_gettime(CLOCK_MONOTONIC, &batch_started[worker]);
     }
 
-    // Insert new packet and header into struct
+    // Insert new packet and a copy of its header into batch, as the header 
+    // is reused by libpcap for the next packet
+    struct packet* pckt = &batch->packets[batch->size++];
     pckt->data = packet_data;
-    pckt->header = header;
+    pckt->header = *header;
+    dispatched[worker]++;
+    dispatched_second = header->ts.tv_sec;
+
+    if (batch->size == settings.batch_size) {
+        flush_batch(worker);
+    }
+}
+
+
+/**
+ * @brief Adds the current batch of a thread to its request queue (if it holds
+ * any packets) and signals its condition variable to 'wake up' the thread.
+ * 
+ * @param worker Index of thread
+ */
+void flush_batch(int worker) {
+    if (current_batches[worker] == NULL) {
+        return;
+    }
 
-    // Add packet to queue and broadcast condition to 'wake up' worker threads
     pthread_mutex_lock(&queue_mutex);
-    enqueue(request_queue, pckt);
-    pthread_cond_broadcast(&cond_var);
-	pthread_mutex_unlock(&queue_mutex);
+    enqueue(request_queues[worker], current_batches[worker]);
+    pthread_cond_signal(&cond_vars[worker]);
+    pthread_mutex_unlock(&queue_mutex);
+
+    batch_count++;
+    current_batches[worker] = NULL;
+}
+
+
+/**
+ * @brief Adds the current batch of each thread to its request queue if it was
+ * started at least BATCH_AGE_LIMIT milliseconds ago. Called whenever 
+ * pcap_dispatch returns, so that partial batches keep filling across calls
+ * (which may each deliver only a few packets per thread) while packets are
+ * not held back for much longer than the capture timeout.
+ * 
+ * @param all Whether to add every current batch regardless of its age, once
+ * no more packets are waiting to be captured
+ */
+void flush_batches(int all) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (int i = 0; i < THREADPOOL_SIZE; i++) {
+        if (current_batches[i] == NULL) {
+            continue;
+        }
+        long age = (now.tv_sec - batch_started[i].tv_sec) * 1000L
+            + (now.tv_nsec - batch_started[i].tv_nsec) / 1000000L;
+        if (all || age >= BATCH_AGE_LIMIT) {
+            flush_batch(i);
+        }
+    }
 }
 
 
 /**
- * @brief Initialises a pool of worker threads by creating a request queue
- * followed by a predefined number of threads.
+ * @brief Frees memory allocated to a batch and the data of each of its packets.
+ * 
+ * @param batch Pointer to batch to free
+ */
+void free_batch(struct packet_batch* batch) {
+    for (int i = 0; i < batch->size; i++) {
+        free((void*) batch->packets[i].data);
+    }
+    free(batch);
+}
+
+
+/**
+ * @brief Initialises a pool of worker threads by creating a predefined number
+ * of threads, each with its own request queue and detector context.
  * 
  */
 void initialise_threadpool() {
-    request_queue = initialise_queue();
 	for (int i = 0; i < THREADPOOL_SIZE; i++) {
-		pthread_create(&threadpool[i], NULL, &thread_code, NULL);
+		request_queues[i] = initialise_queue();
+		pthread_cond_init(&cond_vars[i], NULL);
+		worker_contexts[i] = initialise_detector_context();
+		pthread_create(&threadpool[i], NULL, &thread_code, (void*) (intptr_t) i);
 	}
 }
 
 
 /**
- * @brief Freees memory allocated to the request queue and joins threads.
+ * @brief Stops the threads once they have analysed every packet remaining in
+ * their request queues, or once a deadline has passed, then joins them and frees 
+ * the queues along with any packets abandoned in them. The detector contexts of 
+ * the threads are kept until free_worker_contexts is called.
  * 
+ * @param drain_timeout Milliseconds allowed for draining the queue, or a 
+ * negative value to analyse every remaining packet
  */
-void clean_threadpool() {
+void clean_threadpool(int drain_timeout) {
 
-    // Free queue
+    // Signal threads to stop once queues are empty or deadline has passed
     pthread_mutex_lock(&queue_mutex);
-    free_queue(request_queue);
+    draining = 1;
+    if (drain_timeout >= 0) {
+        has_deadline = 1;
+        clock_gettime(CLOCK_MONOTONIC, &drain_deadline);
+        drain_deadline.tv_sec += drain_timeout / 1000;
+        drain_deadline.tv_nsec += (drain_timeout % 1000) * 1000000L;
+        if (drain_deadline.tv_nsec >= 1000000000L) {
+            drain_deadline.tv_sec++;
+            drain_deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    for (int i = 0; i < THREADPOOL_SIZE; i++) {
+        pthread_cond_signal(&cond_vars[i]);
+    }
     pthread_mutex_unlock(&queue_mutex);
 
     // Join threads
     for (int i = 0; i < THREADPOOL_SIZE; i++) {
-        pthread_cond_broadcast(&cond_var);
         pthread_join(threadpool[i], NULL);
     }
+
+    // Free queues, counting packets which were not analysed in time
+    abandoned_count = 0;
+    for (int i = 0; i < THREADPOOL_SIZE; i++) {
+        abandoned_count += free_queue(request_queues[i]);
+        if (current_batches[i] != NULL) {
+            abandoned_count += current_batches[i]->size;
+            free_batch(current_batches[i]);
+            current_batches[i] = NULL;
+        }
+        pthread_cond_destroy(&cond_vars[i]);
+    }
+}
+
+
+/**
+ * @brief Returns whether the deadline for draining the queue has passed.
+ * Must be called with queue_mutex held.
+ * 
+ * @return int 1 if the deadline has passed, 0 otherwise
+ */
+static int deadline_passed() {
+    if (has_deadline == 0) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec > drain_deadline.tv_sec)
+        || (now.tv_sec == drain_deadline.tv_sec && now.tv_nsec >= drain_deadline.tv_nsec);
+}
+
+
+/**
+ * @brief Returns the last second of capture time up to which every captured 
+ * packet has been analysed. A thread which has not analysed every packet 
+ * handed to it has only completed the seconds before that of the last packet
+ * it analysed, as each thread analyses its packets in capture order. Must only
+ * be called by the capture thread.
+ * 
+ * @param idle Whether every packet received so far has been captured, so that
+ * no more packets from the second of the last captured packet will follow
+ * @return long Last second of capture time analysed
+ */
+long analysed_second(int idle) {
+    long second = idle ? dispatched_second : dispatched_second - 1;
+    for (int i = 0; i < THREADPOOL_SIZE; i++) {
+        unsigned long packets = __atomic_load_n(&worker_contexts[i]->packets, __ATOMIC_ACQUIRE);
+        long last = __atomic_load_n(&worker_contexts[i]->second, __ATOMIC_RELAXED);
+        if (packets < dispatched[i] && last - 1 < second) {
+            second = last - 1;
+        }
+    }
+    return second;
 }
 
 
 /**
- * @brief Code exectued by each thread indefinitely until an interrupt signal 
- * is received. Thread waits for a condition variable to be broadcast, then 
- * dequeues a packet from the work queue and analyses it.
+ * @brief Displays the number of packets analysed by the threads, the number
+ * abandoned when the drain deadline passed and the number of batches in 
+ * which packets were handed to the threads.
  * 
+ */
+void report_threadpool() {
+    unsigned long analysed = 0;
+    for (int i = 0; i < THREADPOOL_SIZE; i++) {
+        analysed += worker_contexts[i]->packets;
+    }
+    printf("%ld packets analysed (%ld abandoned at shutdown)\n", analysed, abandoned_count);
+    printf("%ld batches queued (batch size %d, average %.1f packets)\n",
+        batch_count,
+        settings.batch_size,
+        batch_count > 0 ? (double) (analysed + abandoned_count) / batch_count : 0.0
+    );
+}
+
+
+/**
+ * @brief Frees memory allocated to the detector context of each thread.
+ * 
+ */
+void free_worker_contexts() {
+    for (int i = 0; i < THREADPOOL_SIZE; i++) {
+        free_detector_context(worker_contexts[i]);
+    }
+}
+
+
+/**
+ * @brief Code exectued by each thread until the threadpool is cleaned. Thread
+ * waits for its condition variable to be signalled, then dequeues a batch of 
+ * packets from its request queue and analyses each packet using its own detector 
+ * context, so that no lock is held during analysis. Once draining begins, the
+ * thread continues until its queue is empty or the drain deadline has passed.
+ * 
+ * @param arg Index of the thread
  * @return void* NULL pointer
  */
-void* thread_code() {
+void* thread_code(void* arg) {
 
-    while (program_running == 1) {
+    int worker = (int) (intptr_t) arg;
+    struct detector_context* context = worker_contexts[worker];
+    struct queue* request_queue = request_queues[worker];
 
-        pthread_mutex_lock(&queue_mutex);
+    pthread_mutex_lock(&queue_mutex);
+    for (;;) {
 
-        // Wait for condition variable to be broadcast while queue is empty
-        while ((program_running == 1) && (is_empty(request_queue) == 1)) {  
-            pthread_cond_wait(&cond_var, &queue_mutex);
+        // Wait for condition variable to be signalled while queue is empty
+        while ((draining == 0) && (is_empty(request_queue) == 1)) {  
+            pthread_cond_wait(&cond_vars[worker], &queue_mutex);
         }
 
-        if (program_running == 0) {
+        if (is_empty(request_queue) == 1 || (draining == 1 && deadline_passed() == 1)) {
             break;
         }
 
-        // Retrieve new packet from request queue
+        // Retrieve new batch from request queue
         struct node* node = dequeue(request_queue);
 
         pthread_mutex_unlock(&queue_mutex);
 
-        // Pass packet header and data to analyse function
-        pthread_mutex_lock(&main_mutex);
-        analyse(node->packet->header, node->packet->data);
-        pthread_mutex_unlock(&main_mutex);
+        // Pass header and data of each packet to analyse function, fetching
+        // the headers of the next packet into cache during analysis 
+        // (holding the lock of the context so that a snapshot is not taken 
+        // while its state is being updated)
+        struct packet_batch* batch = node->batch;
+        pthread_mutex_lock(&context->lock);
+        for (int i = 0; i < batch->size; i++) {
+            if (i + 1 < batch->size) {
+                __builtin_prefetch(batch->packets[i + 1].data);
+                __builtin_prefetch(batch->packets[i + 1].data + 64);
+            }
+            analyse(context, &batch->packets[i].header, batch->packets[i].data);
+        }
+        pthread_mutex_unlock(&context->lock);
+
+        // Publish progress, used to decide when thresholds can be evaluated
+        __atomic_store_n(&context->second, (long) batch->packets[batch->size - 1].header.ts.tv_sec, __ATOMIC_RELAXED);
+        __atomic_store_n(&context->packets, context->packets + batch->size, __ATOMIC_RELEASE);
 
-        // Free memory allocated to node
-        free((void*) node->packet->data);
-        free(node->packet);
+        // Free memory allocated to batch and node
+        free_batch(batch);
         free(node);
+
+        pthread_mutex_lock(&queue_mutex);
     }
     pthread_mutex_unlock(&queue_mutex);
     return NULL;
@@ -1,20 +1,47 @@
 #ifndef CS241_DISPATCH_H
 #define CS241_DISPATCH_H
 
+#include "detector.h"
+
 #include <pcap.h>
 
 #define THREADPOOL_SIZE 25
 
-// Struct storing the header of a packet and its remaining data
+// Maximum number of packets handed to worker threads as a single batch
+#define MAX_BATCH_SIZE 256
+
+// Milliseconds a partial batch may be held across calls to pcap_dispatch
+// before it is handed to its thread, trading latency for fuller batches
+#define BATCH_AGE_LIMIT 10
+
+// Struct storing a copy of the header of a packet and its remaining data
 struct packet {
-  const struct pcap_pkthdr* header;
+  struct pcap_pkthdr header;
   const unsigned char* data;
 };
 
+// Struct storing a batch of packets, which is queued and analysed as a unit
+struct packet_batch {
+  int size;
+  struct packet packets[];
+};
+
+// Detector context of each worker thread, and number of packets abandoned
+// when the threadpool was cleaned
+extern struct detector_context* worker_contexts[THREADPOOL_SIZE];
+extern unsigned long abandoned_count;
+extern unsigned long batch_count;
+
 // Function prototypes
 void dispatch(u_char* args, const struct pcap_pkthdr* header, const u_char* packet);
+void flush_batch(int worker);
+void flush_batches(int all);
+void free_batch(struct packet_batch* batch);
+long analysed_second(int idle);
 void initialise_threadpool();
-void clean_threadpool();
-void* thread_code();
+void clean_threadpool(int drain_timeout);
+void report_threadpool();
+void free_worker_contexts();
+void* thread_code(void* arg);
 
 #endif
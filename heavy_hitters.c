@@ -0,0 +1,227 @@
+#include "heavy_hitters.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * @brief Initialises a given summary so that it tracks no keys.
+ *
+ * @param hh Pointer to summary to initialise
+ */
+void initialise_heavy_hitters(struct heavy_hitters* hh) {
+    hh->size = 0;
+    memset(hh->index, -1, sizeof(hh->index));
+}
+
+
+/**
+ * @brief Returns the slot of the index at which the search for a key starts.
+ */
+static int home_slot(uint64_t key) {
+    return (int) ((key * 0x9e3779b97f4a7c15ULL) >> 32) & (HEAVY_HITTERS_SLOTS - 1);
+}
+
+
+/**
+ * @brief Returns the slot of the index holding a given key, or the empty
+ * slot at which it would be inserted.
+ */
+static int find_slot(const struct heavy_hitters* hh, uint64_t key) {
+    int slot = home_slot(key);
+    while (hh->index[slot] != -1 && hh->heap[hh->index[slot]].key != key) {
+        slot = (slot + 1) & (HEAVY_HITTERS_SLOTS - 1);
+    }
+    return slot;
+}
+
+
+/**
+ * @brief Removes the key at a given slot of the index, shifting back any
+ * following keys so that searches remain correct without tombstones.
+ */
+static void remove_slot(struct heavy_hitters* hh, int slot) {
+    hh->index[slot] = -1;
+
+    int next = slot;
+    for (;;) {
+        next = (next + 1) & (HEAVY_HITTERS_SLOTS - 1);
+        if (hh->index[next] == -1) {
+            return;
+        }
+
+        // Move key back if the empty slot lies between its home slot and next
+        int home = home_slot(hh->heap[hh->index[next]].key);
+        int movable = (slot <= next) ? (home <= slot || home > next) : (home <= slot && home > next);
+        if (movable) {
+            hh->index[slot] = hh->index[next];
+            hh->heap[hh->index[slot]].slot = (int16_t) slot;
+            hh->index[next] = -1;
+            slot = next;
+        }
+    }
+}
+
+
+/**
+ * @brief Swaps two entries of the heap, updating their positions in the index.
+ */
+static void swap_entries(struct heavy_hitters* hh, int a, int b) {
+    struct heavy_hitter entry = hh->heap[a];
+    hh->heap[a] = hh->heap[b];
+    hh->heap[b] = entry;
+    hh->index[hh->heap[a].slot] = (int16_t) a;
+    hh->index[hh->heap[b].slot] = (int16_t) b;
+}
+
+
+/**
+ * @brief Moves the heap entry at a given position towards the root while its
+ * count is less than that of its parent.
+ */
+static void sift_up(struct heavy_hitters* hh, int position) {
+    while (position > 0) {
+        int parent = (position - 1) / 2;
+        if (hh->heap[parent].count <= hh->heap[position].count) {
+            return;
+        }
+        swap_entries(hh, position, parent);
+        position = parent;
+    }
+}
+
+
+/**
+ * @brief Moves the heap entry at a given position away from the root while
+ * its count is greater than that of either of its children.
+ */
+static void sift_down(struct heavy_hitters* hh, int position) {
+    for (;;) {
+        int smallest = position;
+        int left = 2 * position + 1;
+        int right = left + 1;
+        if (left < hh->size && hh->heap[left].count < hh->heap[smallest].count) {
+            smallest = left;
+        }
+        if (right < hh->size && hh->heap[right].count < hh->heap[smallest].count) {
+            smallest = right;
+        }
+        if (smallest == position) {
+            return;
+        }
+        swap_entries(hh, position, smallest);
+        position = smallest;
+    }
+}
+
+
+/**
+ * @brief Adds a number of occurrences of a key to a summary. If the key is
+ * not tracked and the summary is full, the key with the smallest count is
+ * replaced, with the new key inheriting its count as error.
+ *
+ * @param hh Pointer to summary to update
+ * @param key Key to add
+ * @param count Number of occurrences of key
+ * @param error Error already associated with count (0 for new occurrences)
+ */
+void add_heavy_hitter(struct heavy_hitters* hh, uint64_t key, unsigned long count, unsigned long error) {
+
+    int slot = find_slot(hh, key);
+
+    // Increase count of tracked key
+    if (hh->index[slot] != -1) {
+        int position = hh->index[slot];
+        hh->heap[position].count += count;
+        hh->heap[position].error += error;
+        sift_down(hh, position);
+        return;
+    }
+
+    // Track new key while there is space
+    if (hh->size < HEAVY_HITTERS_CAPACITY) {
+        int position = hh->size++;
+        hh->heap[position] = (struct heavy_hitter) {key, count, error, (int16_t) slot};
+        hh->index[slot] = (int16_t) position;
+        sift_up(hh, position);
+        return;
+    }
+
+    // Otherwise replace key with smallest count
+    struct heavy_hitter minimum = hh->heap[0];
+    remove_slot(hh, minimum.slot);
+    slot = find_slot(hh, key);
+    hh->heap[0] = (struct heavy_hitter) {key, minimum.count + count, minimum.count + error, (int16_t) slot};
+    hh->index[slot] = 0;
+    sift_down(hh, 0);
+}
+
+
+/**
+ * @brief Adds every key tracked by one summary to another.
+ *
+ * @param dst Pointer to summary to update
+ * @param src Pointer to summary to add
+ */
+void merge_heavy_hitters(struct heavy_hitters* dst, const struct heavy_hitters* src) {
+    for (int i = 0; i < src->size; i++) {
+        add_heavy_hitter(dst, src->heap[i].key, src->heap[i].count, src->heap[i].error);
+    }
+}
+
+
+/**
+ * @brief Checks that a summary read from outside the program (such as a
+ * snapshot) is consistent, so that its positions and slots can safely be used
+ * as indices.
+ *
+ * @param hh Pointer to summary to check
+ * @return int 1 if the summary is consistent, 0 otherwise
+ */
+int valid_heavy_hitters(const struct heavy_hitters* hh) {
+    if (hh->size < 0 || hh->size > HEAVY_HITTERS_CAPACITY) {
+        return 0;
+    }
+    for (int i = 0; i < HEAVY_HITTERS_SLOTS; i++) {
+        if (hh->index[i] < -1 || hh->index[i] >= hh->size) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < hh->size; i++) {
+        if (hh->heap[i].slot < 0 || hh->heap[i].slot >= HEAVY_HITTERS_SLOTS 
+            || hh->index[hh->heap[i].slot] != i) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * @brief Comparison function for sorting keys in descending order of count.
+ */
+static int compare_counts(const void* a, const void* b) {
+    unsigned long count_a = ((const struct heavy_hitter*) a)->count;
+    unsigned long count_b = ((const struct heavy_hitter*) b)->count;
+    return (count_a < count_b) - (count_a > count_b);
+}
+
+
+/**
+ * @brief Copies the keys with the largest counts in a summary to an array,
+ * in descending order of count.
+ *
+ * @param hh Pointer to summary
+ * @param top Array of at least k keys to copy to
+ * @param k Maximum number of keys to copy
+ * @return int Number of keys copied
+ */
+int top_heavy_hitters(const struct heavy_hitters* hh, struct heavy_hitter* top, int k) {
+    struct heavy_hitter sorted[HEAVY_HITTERS_CAPACITY];
+    memcpy(sorted, hh->heap, hh->size * sizeof(struct heavy_hitter));
+    qsort(sorted, hh->size, sizeof(struct heavy_hitter), compare_counts);
+
+    int count = hh->size < k ? hh->size : k;
+    memcpy(top, sorted, count * sizeof(struct heavy_hitter));
+    return count;
+}
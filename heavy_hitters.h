@@ -0,0 +1,39 @@
+#ifndef CS241_HEAVY_HITTERS_H
+#define CS241_HEAVY_HITTERS_H
+
+#include <stdint.h>
+
+// Number of keys tracked by each summary, number of slots in its index
+// (a power of two, at least twice the number of keys) and number of keys
+// displayed in reports
+#define HEAVY_HITTERS_CAPACITY 64
+#define HEAVY_HITTERS_SLOTS 128
+#define HEAVY_HITTERS_TOP 10
+
+// Struct representing a tracked key, whose true count lies between
+// count - error and count
+struct heavy_hitter {
+    uint64_t key;
+    unsigned long count;
+    unsigned long error;
+    int16_t slot;
+};
+
+// Struct representing a Space-Saving summary of the most frequent keys of a
+// stream, using a fixed amount of memory however many distinct keys are
+// seen. Keys are stored in a min-heap ordered by count, with an open
+// addressing index mapping keys to their position in the heap.
+struct heavy_hitters {
+    int size;
+    struct heavy_hitter heap[HEAVY_HITTERS_CAPACITY];
+    int16_t index[HEAVY_HITTERS_SLOTS];
+};
+
+// Function prototypes
+void initialise_heavy_hitters(struct heavy_hitters* hh);
+void add_heavy_hitter(struct heavy_hitters* hh, uint64_t key, unsigned long count, unsigned long error);
+void merge_heavy_hitters(struct heavy_hitters* dst, const struct heavy_hitters* src);
+int top_heavy_hitters(const struct heavy_hitters* hh, struct heavy_hitter* top, int k);
+int valid_heavy_hitters(const struct heavy_hitters* hh);
+
+#endif
@@ -1,21 +1,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 #include <getopt.h>
 
 #include "sniff.h"
 #include "dispatch.h"
+#include "detector.h"
 
 // Command line options
-#define OPTSTRING "vi:"
+#define OPTSTRING "vi:d:w:c:B:It:nD:r:T:b:s:p:"
 static struct option long_opts[] = {
   {"interface", optional_argument, NULL, 'i'},
-  {"verbose",   optional_argument, NULL, 'v'}
+  {"verbose",   optional_argument, NULL, 'v'},
+  {"detectors", required_argument, NULL, 'd'},
+  {"write",     required_argument, NULL, 'w'},
+  {"context",   required_argument, NULL, 'c'},
+  {"buffer-size", required_argument, NULL, 'B'},
+  {"immediate", no_argument,       NULL, 'I'},
+  {"timeout",   required_argument, NULL, 't'},
+  {"nano",      no_argument,       NULL, 'n'},
+  {"drain-timeout", required_argument, NULL, 'D'},
+  {"read",      required_argument, NULL, 'r'},
+  {"threshold", required_argument, NULL, 'T'},
+  {"batch-size", required_argument, NULL, 'b'},
+  {"snapshot",  required_argument, NULL, 's'},
+  {"snapshot-interval", required_argument, NULL, 'p'},
+  {NULL, 0, NULL, 0}
 };
 
 struct arguments {
   char *interface;
   int verbose;
+  char *detectors;
 };
 
 void print_usage(char *progname) {
@@ -23,11 +41,46 @@ void print_usage(char *progname) {
   fprintf(stderr, "Usage: %s [OPTIONS]...\n\n", progname);
   fprintf(stderr, "\t-i [interface]\tSpecify network interface to sniff\n");
   fprintf(stderr, "\t-v\t\tEnable verbose mode. Useful for Debugging\n");
+  fprintf(stderr, "\t-d [list]\tComma separated detectors to enable (syn,arp,blacklist)\n");
+  fprintf(stderr, "\t-w [prefix]\tWrite packets triggering detections to prefix.N.pcap\n");
+  fprintf(stderr, "\t-c [count]\tAlso write the next count packets of each such flow\n");
+  fprintf(stderr, "\t-B [MiB]\tSet size of kernel capture buffer (at most 2047)\n");
+  fprintf(stderr, "\t-I\t\tEnable immediate mode (deliver packets without buffering)\n");
+  fprintf(stderr, "\t-t [ms]\t\tSet capture timeout (default 1000)\n");
+  fprintf(stderr, "\t-n\t\tUse nanosecond timestamp precision\n");
+  fprintf(stderr, "\t-D [ms]\t\tTime allowed to analyse queued packets on exit (default 5000, -1 waits)\n");
+  fprintf(stderr, "\t-r [file]\tReplay packets from a pcap file instead of an interface\n");
+  fprintf(stderr, "\t-T [name=n/s]\tAlert when a detector makes n detections within s seconds\n");
+  fprintf(stderr, "\t-b [count]\tNumber of packets handed to threads at once (default 32, max 256)\n");
+  fprintf(stderr, "\t-s [file]\tRestore detector state from file and save snapshots to it (also on SIGUSR1)\n");
+  fprintf(stderr, "\t-p [s]\t\tSeconds between snapshots (default 60, 0 disables)\n");
+}
+
+/**
+ * @brief Parses the integer argument of an option, printing the usage text
+ * and exiting if it is not a decimal number within [min, max].
+ *
+ * @param progname Name of program
+ * @param arg Argument to parse
+ * @param min Minimum value accepted
+ * @param max Maximum value accepted
+ * @return int Parsed value
+ */
+static int parse_int(char *progname, const char *arg, long min, long max) {
+  char *end;
+  errno = 0;
+  long value = strtol(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || value < min || value > max) {
+    fprintf(stderr, "Invalid argument %s\n", arg);
+    print_usage(progname);
+    exit(EXIT_FAILURE);
+  }
+  return (int) value;
 }
 
 int main(int argc, char *argv[]) {
   // Parse command line arguments
-  struct arguments args = {"eth0", 0}; // Default values
+  struct arguments args = {"eth0", 0, "all"}; // Default values
   int optc;
   while ((optc = getopt_long(argc, argv, OPTSTRING, long_opts, NULL)) != EOF) {
     switch (optc) {
@@ -37,14 +90,74 @@ int main(int argc, char *argv[]) {
       case 'i':
         args.interface = strdup(optarg);
         break;
+      case 'd':
+        args.detectors = optarg;
+        break;
+      case 'w':
+        settings.write_prefix = optarg;
+        break;
+      case 'c':
+        settings.context_packets = parse_int(argv[0], optarg, 0, INT_MAX);
+        break;
+      case 'B':
+        settings.buffer_size = parse_int(argv[0], optarg, 1, INT_MAX >> 20) << 20;
+        break;
+      case 'I':
+        settings.immediate_mode = 1;
+        break;
+      case 't':
+        settings.timeout = parse_int(argv[0], optarg, 0, INT_MAX);
+        break;
+      case 'n':
+        settings.nanosecond_precision = 1;
+        break;
+      case 'D':
+        settings.drain_timeout = parse_int(argv[0], optarg, -1, INT_MAX);
+        break;
+      case 'r':
+        settings.read_file = optarg;
+        break;
+      case 'b':
+        settings.batch_size = parse_int(argv[0], optarg, 1, MAX_BATCH_SIZE);
+        break;
+      case 's':
+        settings.snapshot_file = optarg;
+        break;
+      case 'p':
+        settings.snapshot_interval = parse_int(argv[0], optarg, 0, INT_MAX);
+        break;
+      case 'T':
+        if (add_threshold(optarg) != 0) {
+          print_usage(argv[0]);
+          exit(EXIT_FAILURE);
+        }
+        break;
       default:
         print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
   }
+  // Enable selected detectors
+  if (select_detectors(args.detectors) != 0) {
+    print_usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
   // Print out settings
   printf("%s invoked. Settings:\n", argv[0]);
   printf("\tInterface: %s\n\tVerbose: %d\n", args.interface, args.verbose);
+  printf("\tDetectors: %s\n", args.detectors);
+  printf("\tBuffer size: %d\n\tImmediate: %d\n\tTimeout: %d\n\tNanosecond: %d\n",
+    settings.buffer_size, settings.immediate_mode, settings.timeout, settings.nanosecond_precision);
+  printf("\tDrain timeout: %d\n\tBatch size: %d\n", settings.drain_timeout, settings.batch_size);
+  if (settings.read_file != NULL) {
+    printf("\tRead: %s\n", settings.read_file);
+  }
+  if (settings.write_prefix != NULL) {
+    printf("\tWrite: %s.N.pcap (%d context packets)\n", settings.write_prefix, settings.context_packets);
+  }
+  if (settings.snapshot_file != NULL) {
+    printf("\tSnapshot: %s (every %d s)\n", settings.snapshot_file, settings.snapshot_interval);
+  }
   // Invoke Intrusion Detection System
   sniff(args.interface, args.verbose);
   return 0;
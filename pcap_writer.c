@@ -0,0 +1,443 @@
+#include "pcap_writer.h"
+#include "analysis.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <pcap.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+
+// Magic numbers (for microsecond and nanosecond timestamps), version and 
+// link type written to the header of each file
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NANO 0xa1b23c4d
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+#define LINKTYPE_ETHERNET 1
+
+// Struct representing the global header of a pcap file
+struct capture_file_header {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+// Struct representing the header of each packet in a pcap file
+struct capture_record_header {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+// Struct representing a slot of the ring, which can be written once its
+// sequence number equals the enqueue position and read once it is one greater
+struct ring_slot {
+    unsigned long sequence;
+    struct pcap_pkthdr header;
+    unsigned char data[WRITER_SNAPLEN];
+};
+
+// Struct identifying a flow in either direction, with the number of context
+// packets still to be recorded
+struct followed_flow {
+    uint32_t addr_a;
+    uint32_t addr_b;
+    uint16_t port_a;
+    uint16_t port_b;
+    uint8_t protocol;
+    int remaining;
+};
+
+// Ring of packets waiting to be written, with the positions of its producers
+// (worker threads) and its single consumer (writer thread)
+static struct ring_slot* ring;
+static unsigned long enqueue_pos;
+static unsigned long dequeue_pos;
+
+// Writer thread and the file it is currently writing to
+static pthread_t writer_thread;
+static int writer_enabled = 0;
+static int writer_running = 0;
+static const char* file_prefix;
+static int file_nanosecond;
+static FILE* file;
+static int file_index;
+static size_t file_bytes;
+static time_t last_open;
+
+// Flows followed to record context packets
+static struct followed_flow* followed;
+static pthread_mutex_t followed_mutexes[WRITER_LOCKS];
+static int context_packets;
+static int followed_count;
+
+// Number of packets written, and lost because the ring was full or a write failed
+static unsigned long written = 0;
+static unsigned long dropped = 0;
+static unsigned long write_errors = 0;
+static unsigned long open_errors = 0;
+
+
+/**
+ * @brief Opens the rotating file with a given index for writing, replacing
+ * any existing file, and writes the pcap global header to it.
+ *
+ * @param index Index of file to open
+ */
+static void open_file(int index) {
+
+    char name[4096];
+    snprintf(name, sizeof(name), "%s.%d.pcap", file_prefix, index);
+
+    file = fopen(name, "wb");
+    file_index = index;
+    file_bytes = 0;
+    last_open = time(NULL);
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open %s for writing\n", name);
+        open_errors++;
+        return;
+    }
+
+    // Batch writes using a large buffer
+    setvbuf(file, NULL, _IOFBF, WRITER_BUFFER_SIZE);
+
+    struct capture_file_header file_header = {
+        file_nanosecond ? PCAP_MAGIC_NANO : PCAP_MAGIC, PCAP_VERSION_MAJOR, PCAP_VERSION_MINOR, 0, 0, WRITER_SNAPLEN, LINKTYPE_ETHERNET
+    };
+    file_bytes = fwrite(&file_header, 1, sizeof(file_header), file);
+}
+
+
+/**
+ * @brief Writes a packet to the current file, moving on to the next file
+ * (overwriting the oldest) once the current file reaches its size limit. If
+ * the next file could not be opened, opening the file after it is retried
+ * every WRITER_RETRY seconds, with packets counted as write errors meanwhile.
+ *
+ * @param slot Ring slot holding packet to write
+ */
+static void write_packet(const struct ring_slot* slot) {
+
+    struct capture_record_header record = {
+        (uint32_t) slot->header.ts.tv_sec,
+        (uint32_t) slot->header.ts.tv_usec,
+        slot->header.caplen,
+        slot->header.len
+    };
+
+    // Rotate files once size limit is reached
+    if (file != NULL && file_bytes + sizeof(record) + record.incl_len > WRITER_FILE_SIZE) {
+        fclose(file);
+        open_file((file_index + 1) % WRITER_FILES);
+    } else if (file == NULL && time(NULL) - last_open >= WRITER_RETRY) {
+        open_file((file_index + 1) % WRITER_FILES);
+    }
+
+    if (file == NULL
+        || fwrite(&record, sizeof(record), 1, file) != 1
+        || fwrite(slot->data, 1, record.incl_len, file) != record.incl_len
+    ) {
+        write_errors++;
+        return;
+    }
+    file_bytes += sizeof(record) + record.incl_len;
+    written++;
+}
+
+
+/**
+ * @brief Writes every packet currently in the ring to file, releasing each
+ * slot for reuse by the worker threads.
+ *
+ * @return int Number of packets removed from the ring
+ */
+static int drain_ring() {
+
+    int count = 0;
+    while (count < WRITER_RING_SIZE) {
+        struct ring_slot* slot = &ring[dequeue_pos & (WRITER_RING_SIZE - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != dequeue_pos + 1) {
+            break;
+        }
+        write_packet(slot);
+        __atomic_store_n(&slot->sequence, dequeue_pos + WRITER_RING_SIZE, __ATOMIC_RELEASE);
+        dequeue_pos++;
+        count++;
+    }
+    return count;
+}
+
+
+/**
+ * @brief Code executed by the writer thread until the writer is freed. The
+ * thread repeatedly drains the ring, sleeping briefly and flushing the file
+ * whenever the ring is empty.
+ *
+ * @return void* NULL pointer
+ */
+static void* writer_code(void* arg) {
+
+    struct timespec idle = {0, 1000000};
+    while (drain_ring() > 0 || __atomic_load_n(&writer_running, __ATOMIC_ACQUIRE) == 1) {
+        if (__atomic_load_n(&ring[dequeue_pos & (WRITER_RING_SIZE - 1)].sequence, __ATOMIC_ACQUIRE) != dequeue_pos + 1) {
+            if (file != NULL) {
+                fflush(file);
+            }
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Starts writing packets which trigger detections, and optionally a
+ * number of subsequent packets of the same flow, to rotating pcap files.
+ *
+ * @param prefix Prefix of file names (files are named prefix.N.pcap)
+ * @param context Number of packets of context to record per flow
+ * @param nanosecond Whether packet timestamps have nanosecond precision
+ */
+void initialise_writer(const char* prefix, int context, int nanosecond) {
+
+    // Allocate memory for ring and followed flows
+    ring = (struct ring_slot*) malloc(WRITER_RING_SIZE * sizeof(struct ring_slot));
+    followed = (struct followed_flow*) calloc(WRITER_FLOWS, sizeof(struct followed_flow));
+    if (ring == NULL || followed == NULL) {
+        fprintf(stderr, "Unable to allocate memory for pcap writer\n");
+        exit(1);
+    }
+
+    // Mark each slot as writable by the producer at the same position
+    for (unsigned long i = 0; i < WRITER_RING_SIZE; i++) {
+        ring[i].sequence = i;
+    }
+    enqueue_pos = 0;
+    dequeue_pos = 0;
+
+    for (int i = 0; i < WRITER_LOCKS; i++) {
+        pthread_mutex_init(&followed_mutexes[i], NULL);
+    }
+    context_packets = context;
+    followed_count = 0;
+
+    // Open first file and start writer thread
+    file_prefix = prefix;
+    file_nanosecond = nanosecond;
+    open_file(0);
+    if (file == NULL) {
+        exit(1);
+    }
+    writer_running = 1;
+    writer_enabled = 1;
+    pthread_create(&writer_thread, NULL, &writer_code, NULL);
+}
+
+
+/**
+ * @brief Stops the writer thread once every packet in the ring has been
+ * written, then frees memory allocated to the writer. Must only be called
+ * once the worker threads have been joined.
+ *
+ */
+void free_writer() {
+    if (writer_enabled == 0) {
+        return;
+    }
+    __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+
+    for (int i = 0; i < WRITER_LOCKS; i++) {
+        pthread_mutex_destroy(&followed_mutexes[i]);
+    }
+    free(ring);
+    free(followed);
+    writer_enabled = 0;
+}
+
+
+/**
+ * @brief Copies a packet into the next free slot of the ring, or counts it
+ * as dropped if the ring is full, so that worker threads never wait for the
+ * writer thread.
+ */
+static void enqueue_packet(const struct pcap_pkthdr* header, const unsigned char* packet) {
+
+    struct ring_slot* slot;
+    unsigned long pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+
+    // Claim slot at enqueue position
+    for (;;) {
+        slot = &ring[pos & (WRITER_RING_SIZE - 1)];
+        long diff = (long) (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Copy packet into slot and publish it to the writer thread
+    slot->header = *header;
+    if (slot->header.caplen > WRITER_SNAPLEN) {
+        slot->header.caplen = WRITER_SNAPLEN;
+    }
+    memcpy(slot->data, packet, slot->header.caplen);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * @brief Parses the addresses and ports of an IP packet into a flow which
+ * is identical for both directions of the connection.
+ *
+ * @return int 1 if the packet is an IP packet, 0 otherwise
+ */
+static int parse_flow(const struct pcap_pkthdr* header, const unsigned char* packet, struct followed_flow* flow) {
+
+    struct ether_header* ether_header = (struct ether_header*) packet;
+    if (header->caplen < ETH_HLEN + sizeof(struct iphdr) || ntohs(ether_header->ether_type) != ETHERTYPE_IP) {
+        return 0;
+    }
+
+    struct iphdr* ip_header = (struct iphdr*) (packet + ETH_HLEN);
+    uint16_t ports[2] = {0, 0};
+    unsigned int offset = ETH_HLEN + (ip_header->ihl * 4);
+    if ((ip_header->protocol == IPPROTO_TCP || ip_header->protocol == IPPROTO_UDP)
+        && header->caplen >= offset + sizeof(ports)) {
+        memcpy(ports, packet + offset, sizeof(ports));
+    }
+
+    // Order endpoints so that both directions share the same flow
+    memset(flow, 0, sizeof(struct followed_flow));
+    int swap = (ip_header->saddr > ip_header->daddr)
+        || (ip_header->saddr == ip_header->daddr && ports[0] > ports[1]);
+    flow->addr_a = swap ? ip_header->daddr : ip_header->saddr;
+    flow->addr_b = swap ? ip_header->saddr : ip_header->daddr;
+    flow->port_a = swap ? ports[1] : ports[0];
+    flow->port_b = swap ? ports[0] : ports[1];
+    flow->protocol = ip_header->protocol;
+    return 1;
+}
+
+
+/**
+ * @brief Returns the slot of the followed flow table used by a given flow.
+ */
+static unsigned int find_slot(const struct followed_flow* flow) {
+    uint64_t hash = ((uint64_t) flow->addr_a << 32) | flow->addr_b;
+    hash ^= ((uint64_t) flow->port_a << 24) ^ ((uint64_t) flow->port_b << 8) ^ flow->protocol;
+    hash *= 0x9e3779b97f4a7c15ULL;
+    return (unsigned int) (hash >> 40) % WRITER_FLOWS;
+}
+
+
+/**
+ * @brief Updates the followed flow table for a packet, starting to follow
+ * its flow if it triggered a detection, and otherwise consuming one of the
+ * context packets remaining for its flow.
+ *
+ * @return int 1 if the packet should be recorded as context, 0 otherwise
+ */
+static int follow_flow(const struct pcap_pkthdr* header, const unsigned char* packet, int detections) {
+
+    struct followed_flow flow;
+    if (parse_flow(header, packet, &flow) == 0) {
+        return 0;
+    }
+
+    unsigned int slot = find_slot(&flow);
+    pthread_mutex_t* mutex = &followed_mutexes[slot % WRITER_LOCKS];
+    struct followed_flow* entry = &followed[slot];
+    int record = 0;
+
+    pthread_mutex_lock(mutex);
+    int match = (entry->remaining > 0)
+        && entry->addr_a == flow.addr_a && entry->addr_b == flow.addr_b
+        && entry->port_a == flow.port_a && entry->port_b == flow.port_b
+        && entry->protocol == flow.protocol;
+
+    if (detections > 0) {
+
+        // Follow flow, replacing any other flow using the same slot
+        if (entry->remaining == 0) {
+            __atomic_fetch_add(&followed_count, 1, __ATOMIC_RELAXED);
+        }
+        flow.remaining = context_packets;
+        *entry = flow;
+
+    } else if (match == 1) {
+        record = 1;
+        if (--entry->remaining == 0) {
+            __atomic_fetch_sub(&followed_count, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(mutex);
+
+    return record;
+}
+
+
+/**
+ * @brief Records a packet to file if it triggered a detection or belongs to
+ * a flow which recently triggered one. Does nothing if the writer has not
+ * been initialised.
+ *
+ * @param header Header of packet
+ * @param packet Packet data
+ * @param detections Number of detections triggered by the packet
+ */
+void record_packet(const struct pcap_pkthdr* header, const unsigned char* packet, int detections) {
+
+    if (writer_enabled == 0) {
+        return;
+    }
+
+    // Only look up flow if context is enabled and some flow is being followed
+    int context = 0;
+    if (context_packets > 0 && (detections > 0 || __atomic_load_n(&followed_count, __ATOMIC_RELAXED) > 0)) {
+        context = follow_flow(header, packet, detections);
+    }
+
+    if (detections > 0 || context == 1) {
+        enqueue_packet(header, packet);
+    }
+}
+
+
+/**
+ * @brief Displays the number of packets written to file and lost.
+ *
+ */
+void report_writer() {
+    if (file_prefix == NULL) {
+        return;
+    }
+    printf("%ld packets written to %s.N.pcap (%ld dropped, %ld write errors, %ld files not opened)\n",
+        written,
+        file_prefix,
+        dropped,
+        write_errors,
+        open_errors
+    );
+}
@@ -0,0 +1,31 @@
+#ifndef CS241_PCAP_WRITER_H
+#define CS241_PCAP_WRITER_H
+
+#include <pcap.h>
+
+// Number of slots in the ring shared by worker threads and the writer
+// thread (must be a power of two), and bytes of packet data kept per slot
+#define WRITER_RING_SIZE 1024
+#define WRITER_SNAPLEN 4096
+
+// Size of the buffer used to batch writes, and size and number of the
+// files rotated between
+#define WRITER_BUFFER_SIZE (1 << 20)
+#define WRITER_FILE_SIZE (64 << 20)
+#define WRITER_FILES 8
+
+// Seconds between attempts to open the next file if one could not be opened
+#define WRITER_RETRY 1
+
+// Number of flows followed to record context packets, and number of locks
+// guarding them
+#define WRITER_FLOWS 4096
+#define WRITER_LOCKS 64
+
+// Function prototypes
+void initialise_writer(const char* prefix, int context, int nanosecond);
+void free_writer();
+void record_packet(const struct pcap_pkthdr* header, const unsigned char* packet, int detections);
+void report_writer();
+
+#endif
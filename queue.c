@@ -29,22 +29,26 @@ struct queue* initialise_queue() {
 
 
 /**
- * @brief Frees memory allocated to each node in the queue as well 
- * as the queue itself.
+ * @brief Frees memory allocated to each node in the queue and the batch of
+ * packets it stores, as well as the queue itself.
  * 
  * @param queue Pointer to queue to free
+ * @return unsigned long Number of packets which were still in the queue
  */
-void free_queue(struct queue* queue) {
+unsigned long free_queue(struct queue* queue) {
 
     // Continue dequeing and freeing each node until queue is empty
+    unsigned long count = 0;
     while (is_empty(queue) == 0) {
         struct node* node = dequeue(queue);
-        free((void*) node->packet);
+        count += node->batch->size;
+        free_batch(node->batch);
         free(node);
     }
 
     // Free memory allocated to queue itself
     free(queue);
+    return count;
 }
 
 
@@ -60,16 +64,16 @@ int is_empty(struct queue* queue) {
 
 
 /**
- * @brief Inserts a given packet at the back of the queue.
+ * @brief Inserts a given batch of packets at the back of the queue.
  * 
  * @param queue Pointer to queue in which to insert
- * @param packet Packet to insert into queue
+ * @param batch Batch to insert into queue
  */
-void enqueue(struct queue* queue, struct packet* packet) { 
+void enqueue(struct queue* queue, struct packet_batch* batch) { 
 
-    // Create new node to store packet
+    // Create new node to store batch
     struct node* new = (struct node*) malloc(sizeof(struct node));
-    new->packet = packet;
+    new->batch = batch;
     new->next = NULL;
 
     // Update pointers to first and last elements of queue
@@ -86,10 +90,10 @@ void enqueue(struct queue* queue, struct packet* packet) {
 
 
 /**
- * @brief Removes and returns the packet at the front of the given queue.
+ * @brief Removes and returns the batch at the front of the given queue.
  *
  * @param queue Pointer to queue from which to remove
- * @return struct node* Packet removed from the front of the queue
+ * @return struct node* Node holding batch removed from the front of the queue
  */
 struct node* dequeue(struct queue* queue) { 
 
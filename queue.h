@@ -3,10 +3,10 @@
 
 #include "dispatch.h"
 
-// Struct representing a packet stored in the queue with a 
+// Struct representing a batch of packets stored in the queue with a 
 // pointer to the next node
 struct node { 
-	struct packet* packet;
+	struct packet_batch* batch;
 	struct node* next;
 };
 
@@ -19,9 +19,9 @@ struct queue {
 
 // Function prototypes
 struct queue* initialise_queue();
-void free_queue(struct queue* queue);
+unsigned long free_queue(struct queue* queue);
 int is_empty(struct queue* queue);
-void enqueue(struct queue* queue, struct packet* packet);
+void enqueue(struct queue* queue, struct packet_batch* batch);
 struct node* dequeue(struct queue* queue);
 
 #endif
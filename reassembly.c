@@ -0,0 +1,598 @@
+#define _GNU_SOURCE
+#include "reassembly.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define REASSEMBLY_BUCKETS (REASSEMBLY_FLOWS / REASSEMBLY_BUCKET_SIZE)
+
+// Struct representing a byte range [start, end) buffered for a flow
+struct byte_range {
+    uint16_t start;
+    uint16_t end;
+};
+
+// Struct representing a tracked flow, buffering the stream from base_seq
+// until the end of the current block of HTTP headers. While awaiting is set,
+// base_seq marks the start of a request, so that segments arriving ahead of
+// it are buffered.
+struct flow {
+    struct flow_key key;
+    int in_use;
+    int awaiting;
+    uint32_t base_seq;
+    time_t last_seen;
+    int buffer;
+    int range_count;
+    struct byte_range ranges[REASSEMBLY_MAX_RANGES];
+};
+
+// Flow table and the locks guarding each of its buckets
+static struct flow* flows;
+static pthread_mutex_t flow_mutexes[REASSEMBLY_LOCKS];
+static uint64_t hash_seed;
+
+// Last second of capture time analysed by every thread, against which flows
+// of other threads are timed out, and the second of the last sweep
+static long analysed_time = 0;
+static long swept_time = 0;
+
+// Pool of buffers, with a stack of the indices of free buffers
+static unsigned char* buffers;
+static int free_buffers[REASSEMBLY_BUFFERS];
+static int free_count;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * @brief Allocates memory for the flow table and buffer pool and initialises
+ * the locks guarding them.
+ *
+ */
+void initialise_reassembly() {
+
+    // Allocate memory for flow table and buffer pool
+    flows = (struct flow*) calloc(REASSEMBLY_FLOWS, sizeof(struct flow));
+    buffers = (unsigned char*) malloc((size_t) REASSEMBLY_BUFFERS * REASSEMBLY_BUFFER_SIZE);
+    if (flows == NULL || buffers == NULL) {
+        fprintf(stderr, "Unable to allocate memory for stream reassembly\n");
+        exit(1);
+    }
+
+    // Mark every buffer as free
+    for (int i = 0; i < REASSEMBLY_BUFFERS; i++) {
+        free_buffers[i] = i;
+    }
+    free_count = REASSEMBLY_BUFFERS;
+
+    for (int i = 0; i < REASSEMBLY_LOCKS; i++) {
+        pthread_mutex_init(&flow_mutexes[i], NULL);
+    }
+
+    // Seed hash function so that flows cannot be chosen to share a bucket
+    hash_seed = ((uint64_t) time(NULL) << 32) ^ (uint64_t) (uintptr_t) flows;
+}
+
+
+/**
+ * @brief Frees memory allocated to the flow table and buffer pool.
+ *
+ */
+void free_reassembly() {
+    for (int i = 0; i < REASSEMBLY_LOCKS; i++) {
+        pthread_mutex_destroy(&flow_mutexes[i]);
+    }
+    free(flows);
+    free(buffers);
+    flows = NULL;
+    buffers = NULL;
+}
+
+
+/**
+ * @brief Returns the bucket of the flow table in which a given flow is stored.
+ *
+ * @param key Key of flow
+ * @return unsigned int Index of bucket
+ */
+static unsigned int find_bucket(const struct flow_key* key) {
+    uint64_t hash = hash_seed;
+    hash ^= ((uint64_t) key->saddr << 32) | key->daddr;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= ((uint64_t) key->sport << 16) | key->dport;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return (unsigned int) (hash % REASSEMBLY_BUCKETS);
+}
+
+
+/**
+ * @brief Returns a pointer to the buffer at a given index of the pool.
+ */
+static unsigned char* get_buffer(int index) {
+    return buffers + (size_t) index * REASSEMBLY_BUFFER_SIZE;
+}
+
+
+/**
+ * @brief Takes a buffer from the pool.
+ *
+ * @return int Index of buffer, or -1 if the pool is empty
+ */
+static int take_buffer() {
+    int index = -1;
+    pthread_mutex_lock(&pool_mutex);
+    if (free_count > 0) {
+        index = free_buffers[--free_count];
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return index;
+}
+
+
+/**
+ * @brief Returns a buffer to the pool.
+ *
+ * @param index Index of buffer
+ */
+static void return_buffer(int index) {
+    pthread_mutex_lock(&pool_mutex);
+    free_buffers[free_count++] = index;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+
+/**
+ * @brief Returns whether a given stream position holds the start of an HTTP
+ * request, which always begins with an uppercase method name.
+ */
+static int is_request_start(const unsigned char* data, size_t length) {
+    return length > 0 && data[0] >= 'A' && data[0] <= 'Z';
+}
+
+
+/**
+ * @brief Passes each complete block of HTTP headers at the start of the given
+ * data to the callback.
+ *
+ * @return size_t Number of bytes up to the end of the last complete block
+ */
+static size_t scan_blocks(const struct flow_key* key, const unsigned char* data, size_t length,
+    int reassembled, reassembly_callback callback, void* arg) {
+
+    size_t consumed = 0;
+    while (consumed < length) {
+        const unsigned char* end = memmem(data + consumed, length - consumed, "\r\n\r\n", 4);
+        if (end == NULL) {
+            break;
+        }
+        size_t block = (size_t) (end + 4 - (data + consumed));
+        callback(arg, key, data + consumed, block, reassembled);
+        consumed += block;
+    }
+    return consumed;
+}
+
+
+/**
+ * @brief Returns the number of bytes buffered contiguously from the start
+ * of the stream of a given flow.
+ */
+static size_t contiguous_length(const struct flow* flow) {
+    if (flow->range_count > 0 && flow->ranges[0].start == 0) {
+        return flow->ranges[0].end;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Releases the buffer of a given flow back to the pool.
+ */
+static void release_buffer(struct flow* flow) {
+    if (flow->buffer >= 0) {
+        return_buffer(flow->buffer);
+        flow->buffer = -1;
+    }
+    flow->range_count = 0;
+}
+
+
+/**
+ * @brief Passes any incomplete headers buffered for a given flow to the
+ * callback, then stops tracking the flow.
+ */
+static void flush_flow(struct flow* flow, reassembly_callback callback, void* arg) {
+    size_t length = contiguous_length(flow);
+    if (length > 0) {
+        callback(arg, &flow->key, get_buffer(flow->buffer), length, 1);
+    }
+    release_buffer(flow);
+    flow->in_use = 0;
+}
+
+
+/**
+ * @brief Returns whether a flow has been idle for longer than the timeout at
+ * a given second of capture time.
+ */
+static int is_expired(const struct flow* flow, long now) {
+    return flow->in_use == 1 && flow->last_seen + REASSEMBLY_TIMEOUT < now;
+}
+
+
+/**
+ * @brief Returns the flow with a given key in a given bucket, first flushing
+ * any flows in the bucket which have been idle for too long. The flow with
+ * the given key belongs to the calling thread and is timed out against the
+ * capture time of the segment, while flows of other threads (which may lag
+ * behind) are only timed out against the second analysed by every thread.
+ * If the flow is not found and create is set, a new flow is added, evicting
+ * the least recently seen flow of the bucket if it is full (preferring flows
+ * which have no buffered data).
+ *
+ * @param evicted Set to 1 if a flow holding buffered data was evicted
+ * @return struct flow* Pointer to flow, or NULL if not found and not created
+ */
+static struct flow* find_flow(unsigned int bucket, const struct flow_key* key, time_t now, int create,
+    int* evicted, reassembly_callback callback, void* arg) {
+
+    struct flow* slots = &flows[bucket * REASSEMBLY_BUCKET_SIZE];
+    struct flow* empty = NULL;
+    struct flow* oldest = NULL;
+    struct flow* oldest_idle = NULL;
+    long analysed = __atomic_load_n(&analysed_time, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < REASSEMBLY_BUCKET_SIZE; i++) {
+        struct flow* flow = &slots[i];
+        int own = (flow->in_use == 1 && memcmp(&flow->key, key, sizeof(struct flow_key)) == 0);
+
+        // Flush flows which have timed out
+        if (is_expired(flow, own ? now : analysed)) {
+            flush_flow(flow, callback, arg);
+            own = 0;
+        }
+
+        if (flow->in_use == 0) {
+            if (empty == NULL) {
+                empty = flow;
+            }
+        } else if (own) {
+            return flow;
+        } else if (flow->buffer < 0) {
+            if (oldest_idle == NULL || flow->last_seen < oldest_idle->last_seen) {
+                oldest_idle = flow;
+            }
+        } else if (oldest == NULL || flow->last_seen < oldest->last_seen) {
+            oldest = flow;
+        }
+    }
+
+    if (create == 0) {
+        return NULL;
+    }
+
+    // Evict least recently seen flow if bucket is full, which is only
+    // reported if it loses buffered data (flows with no data hold nothing
+    // beyond their sequence number)
+    if (empty == NULL) {
+        if (oldest_idle != NULL) {
+            oldest = oldest_idle;
+        } else {
+            *evicted = 1;
+        }
+        flush_flow(oldest, callback, arg);
+        empty = oldest;
+    }
+
+    memset(empty, 0, sizeof(struct flow));
+    empty->key = *key;
+    empty->in_use = 1;
+    empty->buffer = -1;
+    empty->last_seen = now;
+    return empty;
+}
+
+
+/**
+ * @brief Flushes every flow which has timed out at a given second analysed by
+ * every thread, recovering buffers held by idle flows. Must be called without
+ * holding the lock of any bucket.
+ */
+static void sweep_flows(long analysed, reassembly_callback callback, void* arg) {
+    for (unsigned int bucket = 0; bucket < REASSEMBLY_BUCKETS; bucket++) {
+        unsigned int lock = bucket % REASSEMBLY_LOCKS;
+        pthread_mutex_lock(&flow_mutexes[lock]);
+
+        struct flow* slots = &flows[bucket * REASSEMBLY_BUCKET_SIZE];
+        for (int i = 0; i < REASSEMBLY_BUCKET_SIZE; i++) {
+            if (is_expired(&slots[i], analysed)) {
+                flush_flow(&slots[i], callback, arg);
+            }
+        }
+
+        pthread_mutex_unlock(&flow_mutexes[lock]);
+    }
+}
+
+
+/**
+ * @brief Records the last second of capture time up to which every thread has
+ * analysed its packets, which is used to time out flows of other threads.
+ * Called by the capture thread.
+ *
+ * @param second Last second analysed by every thread
+ */
+void advance_reassembly(long second) {
+    if (second > __atomic_load_n(&analysed_time, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&analysed_time, second, __ATOMIC_RELAXED);
+    }
+}
+
+
+/**
+ * @brief Inserts a byte range into the sorted list of ranges buffered for a
+ * flow, merging it with any ranges it overlaps or touches.
+ *
+ * @return int 0 on success, -1 if the flow has too many disjoint ranges
+ */
+static int add_range(struct flow* flow, uint16_t start, uint16_t end) {
+
+    struct byte_range merged[REASSEMBLY_MAX_RANGES + 1];
+    int count = 0;
+    int inserted = 0;
+
+    for (int i = 0; i < flow->range_count; i++) {
+        struct byte_range range = flow->ranges[i];
+
+        if (range.end < start) {
+            merged[count++] = range;
+        } else if (range.start > end) {
+            if (inserted == 0) {
+                merged[count++] = (struct byte_range) {start, end};
+                inserted = 1;
+            }
+            merged[count++] = range;
+        } else {
+            start = range.start < start ? range.start : start;
+            end = range.end > end ? range.end : end;
+        }
+    }
+    if (inserted == 0) {
+        merged[count++] = (struct byte_range) {start, end};
+    }
+
+    if (count > REASSEMBLY_MAX_RANGES) {
+        return -1;
+    }
+    memcpy(flow->ranges, merged, count * sizeof(struct byte_range));
+    flow->range_count = count;
+    return 0;
+}
+
+
+/**
+ * @brief Copies a segment into the buffer of a flow at the offset given by
+ * its sequence number, taking a buffer from the pool if necessary.
+ *
+ * @return enum reassembly_status REASSEMBLY_DROPPED if the segment lies beyond
+ * the per-flow limit, no buffer is available or the flow has too many gaps
+ */
+static enum reassembly_status store_segment(struct flow* flow, uint32_t seq,
+    const unsigned char* payload, size_t length, reassembly_callback callback, void* arg) {
+
+    // Trim bytes preceding the start of the buffer (retransmitted data)
+    int32_t offset = (int32_t) (seq - flow->base_seq);
+    if (offset < 0) {
+        if ((size_t) -offset >= length) {
+            return REASSEMBLY_OK;
+        }
+        payload += -offset;
+        length -= -offset;
+        offset = 0;
+    }
+    if (offset >= REASSEMBLY_BUFFER_SIZE) {
+        return REASSEMBLY_DROPPED;
+    }
+    if (length > (size_t) (REASSEMBLY_BUFFER_SIZE - offset)) {
+        length = REASSEMBLY_BUFFER_SIZE - offset;
+    }
+
+    // Take buffer from pool
+    if (flow->buffer < 0) {
+        flow->buffer = take_buffer();
+        if (flow->buffer < 0) {
+            return REASSEMBLY_DROPPED;
+        }
+    }
+
+    if (add_range(flow, (uint16_t) offset, (uint16_t) (offset + length)) != 0) {
+        flush_flow(flow, callback, arg);
+        return REASSEMBLY_DROPPED;
+    }
+    memcpy(get_buffer(flow->buffer) + offset, payload, length);
+    return REASSEMBLY_OK;
+}
+
+
+/**
+ * @brief Passes each complete block of headers buffered for a flow to the
+ * callback and discards it. If an incomplete request follows the last block,
+ * it is moved to the start of the buffer; otherwise (as the block is followed
+ * by a request body) the buffer is released until a segment starts a new
+ * request. If the buffer fills up without the headers ending, its contents
+ * are passed to the callback and the buffer is released.
+ */
+static void consume_blocks(struct flow* flow, reassembly_callback callback, void* arg) {
+
+    unsigned char* buffer = get_buffer(flow->buffer);
+    size_t length = contiguous_length(flow);
+    size_t consumed = scan_blocks(&flow->key, buffer, length, 1, callback, arg);
+
+    if (consumed == 0) {
+        if (length == REASSEMBLY_BUFFER_SIZE) {
+            callback(arg, &flow->key, buffer, length, 1);
+            release_buffer(flow);
+            flow->awaiting = 0;
+        }
+        return;
+    }
+    flow->base_seq += consumed;
+
+    // Stop buffering unless the headers are followed by another request
+    if (is_request_start(buffer + consumed, length - consumed) == 0) {
+        release_buffer(flow);
+        flow->awaiting = 0;
+        return;
+    }
+
+    // Shift remaining ranges and bytes to the start of the buffer
+    int count = 0;
+    size_t end = 0;
+    for (int i = 0; i < flow->range_count; i++) {
+        struct byte_range range = flow->ranges[i];
+        if (range.end <= consumed) {
+            continue;
+        }
+        range.start = range.start > consumed ? range.start - consumed : 0;
+        range.end -= consumed;
+        end = range.end;
+        flow->ranges[count++] = range;
+    }
+    memmove(buffer, buffer + consumed, end);
+    flow->range_count = count;
+}
+
+
+/**
+ * @brief Passes each complete block of headers in a segment which starts a
+ * request straight to the callback, without copying the segment. If an
+ * incomplete request follows them, it is buffered (creating a flow for it if
+ * necessary) unless the client is closing the connection, in which case it
+ * is also passed to the callback.
+ *
+ * @param flow Pointer to flow the segment belongs to, or NULL if not tracked
+ * @param evicted Set to 1 if a live flow was evicted to track the segment
+ * @return enum reassembly_status Whether any incomplete request could be buffered
+ */
+static enum reassembly_status scan_segment(struct flow* flow, unsigned int bucket, const struct flow_key* key,
+    uint32_t seq, int flags, const unsigned char* payload, size_t length, time_t now, int* evicted,
+    reassembly_callback callback, void* arg) {
+
+    size_t consumed = scan_blocks(key, payload, length, 0, callback, arg);
+    const unsigned char* remainder = payload + consumed;
+    size_t remaining = length - consumed;
+
+    if (is_request_start(remainder, remaining) == 0) {
+        if (flow != NULL) {
+            flow->awaiting = 0;
+        }
+        return REASSEMBLY_OK;
+    }
+    if (flags & REASSEMBLY_FIN) {
+        callback(arg, key, remainder, remaining, 0);
+        return REASSEMBLY_OK;
+    }
+
+    if (flow == NULL) {
+        flow = find_flow(bucket, key, now, 1, evicted, callback, arg);
+    }
+    flow->base_seq = seq + consumed;
+    flow->awaiting = 1;
+    return store_segment(flow, seq + consumed, remainder, remaining, callback, arg);
+}
+
+
+/**
+ * @brief Passes a segment of a client to server TCP stream to the reassembler.
+ * Complete blocks of HTTP headers contained in a single segment are passed
+ * straight to the callback; otherwise the incomplete request is buffered, up 
+ * to REASSEMBLY_BUFFER_SIZE bytes per flow, until the headers end or the flow
+ * is closed or times out. Request bodies are never buffered.
+ *
+ * @param key Key of flow the segment belongs to
+ * @param seq Sequence number of the segment
+ * @param flags Combination of REASSEMBLY_SYN and REASSEMBLY_FIN
+ * @param payload Payload of the segment
+ * @param length Number of bytes in payload
+ * @param now Capture time of the segment in seconds
+ * @param callback Function called with each block of headers
+ * @param arg Argument passed to callback
+ * @return enum reassembly_status Whether the segment could be buffered
+ */
+enum reassembly_status reassemble_segment(const struct flow_key* key, uint32_t seq, int flags,
+    const unsigned char* payload, size_t length, time_t now, reassembly_callback callback, void* arg) {
+
+    unsigned int bucket = find_bucket(key);
+    unsigned int lock = bucket % REASSEMBLY_LOCKS;
+    enum reassembly_status status = REASSEMBLY_OK;
+    int evicted = 0;
+
+    // Flush flows which timed out before the second analysed by every thread
+    // whenever it advances, so that buffers held by idle flows are recovered
+    long analysed = __atomic_load_n(&analysed_time, __ATOMIC_RELAXED);
+    long swept = __atomic_load_n(&swept_time, __ATOMIC_RELAXED);
+    if (analysed > swept && __atomic_compare_exchange_n(&swept_time, &swept, analysed, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        sweep_flows(analysed, callback, arg);
+    }
+
+    pthread_mutex_lock(&flow_mutexes[lock]);
+    struct flow* flow = find_flow(bucket, key, now, 0, &evicted, callback, arg);
+
+    if (flow == NULL) {
+
+        // Start tracking stream when client opens connection
+        if (flags & REASSEMBLY_SYN) {
+            flow = find_flow(bucket, key, now, 1, &evicted, callback, arg);
+            flow->base_seq = seq + 1;
+            flow->awaiting = 1;
+
+        // Otherwise handle complete headers directly, and only buffer the
+        // remainder of the segment if it starts a new request
+        } else if (is_request_start(payload, length)) {
+            status = scan_segment(NULL, bucket, key, seq, flags, payload, length, now, &evicted, callback, arg);
+        }
+
+    } else {
+
+        if (now > flow->last_seen) {
+            flow->last_seen = now;
+        }
+
+        // Restart stream if the client reopens the connection
+        if (flags & REASSEMBLY_SYN) {
+            release_buffer(flow);
+            flow->awaiting = 1;
+            flow->base_seq = seq + 1;
+        }
+
+        // Buffer segment if it continues incomplete headers (or arrives ahead
+        // of the start of a request) and pass on any headers which are now 
+        // complete, otherwise handle it in place if it starts a new request
+        if (length > 0 && (flow->buffer >= 0 || (flow->awaiting == 1 && seq != flow->base_seq))) {
+            status = store_segment(flow, seq, payload, length, callback, arg);
+            if (flow->in_use == 1 && flow->buffer >= 0) {
+                consume_blocks(flow, callback, arg);
+            }
+        } else if (is_request_start(payload, length)) {
+            status = scan_segment(flow, bucket, key, seq, flags, payload, length, now, &evicted, callback, arg);
+        } else if (length > 0) {
+            flow->awaiting = 0;
+        }
+
+        // Stop tracking stream once client closes connection
+        if ((flags & REASSEMBLY_FIN) && flow->in_use == 1) {
+            flush_flow(flow, callback, arg);
+        }
+    }
+
+    pthread_mutex_unlock(&flow_mutexes[lock]);
+
+    if (status == REASSEMBLY_OK && evicted == 1) {
+        status = REASSEMBLY_EVICTED;
+    }
+    return status;
+}
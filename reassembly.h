@@ -0,0 +1,57 @@
+#ifndef CS241_REASSEMBLY_H
+#define CS241_REASSEMBLY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Maximum number of bytes buffered per flow, and number of buffers in the
+// pool shared by all flows (bounding the memory used to 4 MiB)
+#define REASSEMBLY_BUFFER_SIZE 4096
+#define REASSEMBLY_BUFFERS 1024
+
+// Number of flows tracked, grouped into buckets sharing a hash value, and
+// number of locks guarding the buckets
+#define REASSEMBLY_FLOWS 8192
+#define REASSEMBLY_BUCKET_SIZE 4
+#define REASSEMBLY_LOCKS 256
+
+// Maximum number of disjoint byte ranges buffered per flow
+#define REASSEMBLY_MAX_RANGES 8
+
+// Seconds (in capture time) after which an idle flow is flushed
+#define REASSEMBLY_TIMEOUT 30
+
+// TCP flags relevant to reassembly
+#define REASSEMBLY_SYN 0x1
+#define REASSEMBLY_FIN 0x2
+
+// Struct identifying a client to server TCP stream
+struct flow_key {
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t sport;
+    uint16_t dport;
+};
+
+// Result of passing a segment to the reassembler
+enum reassembly_status {
+    REASSEMBLY_OK,       // Segment was consumed or buffered
+    REASSEMBLY_EVICTED,  // Segment was buffered after evicting another live flow
+    REASSEMBLY_DROPPED   // Segment could not be buffered within the limits
+};
+
+// Function called with each complete (or flushed) block of HTTP headers and
+// the flow it was sent on, with reassembled set if the block was built from
+// more than one segment
+typedef void (*reassembly_callback)(void* arg, const struct flow_key* key, const unsigned char* data,
+    size_t length, int reassembled);
+
+// Function prototypes
+void initialise_reassembly();
+void free_reassembly();
+void advance_reassembly(long second);
+enum reassembly_status reassemble_segment(const struct flow_key* key, uint32_t seq, int flags,
+    const unsigned char* payload, size_t length, time_t now, reassembly_callback callback, void* arg);
+
+#endif
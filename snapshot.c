@@ -0,0 +1,235 @@
+#include "snapshot.h"
+#include "detector.h"
+#include "dispatch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Path of snapshot file and of the temporary file written before replacing it
+static const char* snapshot_path = NULL;
+static char* temporary_path;
+static int snapshot_interval;
+
+// Snapshot thread, woken by the semaphore when a snapshot is requested
+static pthread_t snapshot_thread;
+static sem_t snapshot_requested;
+static int snapshot_running = 0;
+
+// Mapping of the snapshot restored at startup, which holds the restored
+// states and is kept until the program exits
+static void* mapping = NULL;
+static size_t mapping_size;
+
+// Counters reported in the summary
+static int restored = 0;
+static unsigned long written = 0;
+static unsigned long failed = 0;
+
+
+/**
+ * @brief Maps the snapshot file into memory and restores the state of each
+ * enabled detector from it. The file is mapped privately, so that restored
+ * states may be modified without changing the file. Starts without restoring
+ * any state if the file does not exist or is not a valid snapshot.
+ */
+static void restore_snapshot() {
+
+    int fd = open(snapshot_path, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Unable to open snapshot %s\n", snapshot_path);
+        }
+        return;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || (size_t) status.st_size < sizeof(struct snapshot_header)) {
+        fprintf(stderr, "Ignoring truncated snapshot %s\n", snapshot_path);
+        close(fd);
+        return;
+    }
+    mapping_size = status.st_size;
+    mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Unable to map snapshot %s\n", snapshot_path);
+        mapping = NULL;
+        return;
+    }
+
+    // Check snapshot was written by a compatible version of the analyser
+    struct snapshot_header* header = (struct snapshot_header*) mapping;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+        || header->version != SNAPSHOT_VERSION || header->long_size != sizeof(long)) {
+        fprintf(stderr, "Ignoring incompatible snapshot %s\n", snapshot_path);
+        munmap(mapping, mapping_size);
+        mapping = NULL;
+        return;
+    }
+
+    restored = restore_detectors((unsigned char*) mapping + sizeof(struct snapshot_header),
+        mapping_size - sizeof(struct snapshot_header));
+}
+
+
+/**
+ * @brief Writes the state of each enabled detector, merged across the worker
+ * threads, to a temporary file which then replaces the snapshot file. As the
+ * file is replaced by renaming, a snapshot interrupted part way through never
+ * overwrites the previous one, and the mapping restored at startup remains
+ * valid.
+ */
+static void write_snapshot() {
+
+    FILE* file = fopen(temporary_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open snapshot %s\n", temporary_path);
+        failed++;
+        return;
+    }
+
+    // Write header, then records, then fill in number of records
+    struct snapshot_header header = {0};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.long_size = sizeof(long);
+    header.time = (int64_t) time(NULL);
+    int records = -1;
+    if (fwrite(&header, sizeof(header), 1, file) == 1) {
+        records = save_detectors(file, worker_contexts, THREADPOOL_SIZE);
+    }
+    if (records >= 0) {
+        header.records = records;
+        if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1
+            || fflush(file) != 0 || fsync(fileno(file)) != 0) {
+            records = -1;
+        }
+    }
+
+    if (fclose(file) != 0 || records < 0 || rename(temporary_path, snapshot_path) != 0) {
+        fprintf(stderr, "Unable to write snapshot %s\n", snapshot_path);
+        unlink(temporary_path);
+        failed++;
+        return;
+    }
+    written++;
+}
+
+
+/**
+ * @brief Code executed by the snapshot thread. Writes a snapshot every
+ * snapshot_interval seconds (if positive) and whenever one is requested,
+ * then writes a final snapshot once stopped.
+ *
+ * @param arg Unused
+ * @return void* NULL pointer
+ */
+static void* snapshot_code(void* arg) {
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += snapshot_interval;
+
+    while (__atomic_load_n(&snapshot_running, __ATOMIC_ACQUIRE) == 1) {
+        int result = (snapshot_interval > 0)
+            ? sem_timedwait(&snapshot_requested, &deadline)
+            : sem_wait(&snapshot_requested);
+        if (result != 0 && errno == ETIMEDOUT) {
+            deadline.tv_sec += snapshot_interval;
+        } else if (result != 0) {
+            continue;
+        }
+        if (__atomic_load_n(&snapshot_running, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        }
+        write_snapshot();
+    }
+
+    write_snapshot();
+    return NULL;
+}
+
+
+/**
+ * @brief Restores detector state from the snapshot file at a given path (if
+ * it exists), then starts a thread writing snapshots to it. Must be called
+ * after the threadpool has been initialised.
+ *
+ * @param path Path of snapshot file
+ * @param interval Seconds between periodic snapshots (0 to disable)
+ */
+void initialise_snapshots(const char* path, int interval) {
+
+    snapshot_path = path;
+    snapshot_interval = interval;
+    temporary_path = (char*) malloc(strlen(path) + 5);
+    if (temporary_path == NULL) {
+        fprintf(stderr, "Unable to allocate memory for snapshot path\n");
+        exit(1);
+    }
+    sprintf(temporary_path, "%s.tmp", path);
+
+    restore_snapshot();
+
+    sem_init(&snapshot_requested, 0, 0);
+    snapshot_running = 1;
+    pthread_create(&snapshot_thread, NULL, &snapshot_code, NULL);
+}
+
+
+/**
+ * @brief Stops the snapshot thread after it has written a final snapshot.
+ * Must be called after the threadpool has been cleaned, so that the final
+ * snapshot holds the state of every analysed packet.
+ *
+ */
+void free_snapshots() {
+    if (snapshot_running == 0) {
+        return;
+    }
+    __atomic_store_n(&snapshot_running, 0, __ATOMIC_RELEASE);
+    sem_post(&snapshot_requested);
+    pthread_join(snapshot_thread, NULL);
+
+    sem_destroy(&snapshot_requested);
+    free(temporary_path);
+}
+
+
+/**
+ * @brief Requests a snapshot from the snapshot thread, if it is running.
+ * Safe to call from a signal handler.
+ *
+ */
+void request_snapshot() {
+    if (__atomic_load_n(&snapshot_running, __ATOMIC_ACQUIRE) == 1) {
+        sem_post(&snapshot_requested);
+    }
+}
+
+
+/**
+ * @brief Displays the number of detector states restored at startup and the
+ * number of snapshots written.
+ *
+ */
+void report_snapshots() {
+    if (snapshot_path == NULL) {
+        return;
+    }
+    printf("%ld snapshots written to %s (%ld failed, %d detector states restored)\n",
+        written,
+        snapshot_path,
+        failed,
+        restored
+    );
+}
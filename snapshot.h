@@ -0,0 +1,41 @@
+#ifndef CS241_SNAPSHOT_H
+#define CS241_SNAPSHOT_H
+
+#include <stdint.h>
+
+// Magic number and version written to the header of each snapshot, where the
+// version must be increased whenever the layout of a saved state changes
+#define SNAPSHOT_MAGIC "CS241SNP"
+#define SNAPSHOT_VERSION 1
+
+// Alignment of each record, so that saved states can be used in place once
+// the snapshot is mapped into memory
+#define SNAPSHOT_ALIGNMENT 8
+#define SNAPSHOT_ALIGN(length) (((length) + SNAPSHOT_ALIGNMENT - 1) & ~((size_t) SNAPSHOT_ALIGNMENT - 1))
+
+// Struct representing the header of a snapshot file. States are saved in the
+// native layout of the analyser, so the size of a long is recorded to reject
+// snapshots written on a different architecture.
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t long_size;
+    uint32_t records;
+    uint32_t reserved;
+    int64_t time;
+};
+
+// Struct representing the header of the record holding the state of a
+// detector, which is followed by length bytes of state padded to the alignment
+struct snapshot_record {
+    char name[24];
+    uint64_t length;
+};
+
+// Function prototypes
+void initialise_snapshots(const char* path, int interval);
+void free_snapshots();
+void request_snapshot();
+void report_snapshots();
+
+#endif
@@ -1,26 +1,33 @@
 #include "sniff.h"
 #include "dispatch.h"
-#include "dynamic_array.h"
+#include "detector.h"
+#include "pcap_writer.h"
+#include "snapshot.h"
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <signal.h>
+#include <time.h>
 #include <pcap.h>
 #include <netinet/if_ether.h>
 
-// Global flags and packet counter
-int program_running = 1;
+// Global flags, settings and packet counter
+volatile sig_atomic_t program_running = 1;
 int verbose_enabled;              
+struct settings settings = {NULL, 0, 0, 0, 1000, 0, 5000, NULL, 32, NULL, 60};
 unsigned long packet_count = 0;
 
-// Global structs and pcap handle
-struct attack_counts* attacks;
-struct dynamic_array ip_addresses;
+// Global pcap handle and statistics reported by it
 pcap_t* pcap_handle;
+struct capture_stats capture_stats;
+static struct pcap_stat last_stats;
+static time_t last_stats_poll = 0;
 
 
 /**
- * @brief Application main sniffing loop.
+ * @brief Application main sniffing loop. Captures packets from the given
+ * interface (or replays them from settings.read_file) until interrupted
+ * or the end of the file is reached, then drains the request queue and
+ * displays the summary.
  * 
  * @param interface Network interface being listened to
  * @param verbose Verbose flag (0/1)
@@ -31,72 +38,170 @@ void sniff(char* interface, int verbose) {
     verbose_enabled = verbose;
     
     // Install signal handler
-    if (signal(SIGINT, signal_handler) == SIG_ERR) {
+    if (signal(SIGINT, signal_handler) == SIG_ERR || signal(SIGUSR1, signal_handler) == SIG_ERR) {
         printf("Unable to install signal handler");
         exit(1);
     };
     
-    char errbuf[PCAP_ERRBUF_SIZE];
-
-    // Open the specified network interface for packet capture
-    pcap_handle = pcap_open_live(interface, BUFSIZE, 1, 1000, errbuf);
-
-    // Ensure interface has been opened
-    if (pcap_handle == NULL) {
-        fprintf(stderr, "Unable to open interface %s\n", errbuf);
-        exit(EXIT_FAILURE);
+    // Open the specified network interface (or file) for packet capture
+    if (settings.read_file != NULL) {
+        open_file(settings.read_file);
+        printf("SUCCESS! Opened %s for replay\n", settings.read_file);
     } else {
+        open_interface(interface);
         printf("SUCCESS! Opened %s for capture\n", interface);
     }
 
-    // Initialise global structs and threadpool
-    initialise_attack_counts();
-    initialise_array(&ip_addresses);
+    // Initialise resources shared by detectors, pcap writer and threadpool,
+    // then restore detector state from the snapshot file
+    setup_detectors();
+    if (settings.write_prefix != NULL) {
+        initialise_writer(settings.write_prefix, settings.context_packets,
+            pcap_get_tstamp_precision(pcap_handle) == PCAP_TSTAMP_PRECISION_NANO);
+    }
     initialise_threadpool();
+    if (settings.snapshot_file != NULL) {
+        initialise_snapshots(settings.snapshot_file, settings.snapshot_interval);
+    }
     
-    // When pcap loop stops capturing packets
-    if (pcap_loop(pcap_handle, -1, dispatch, NULL) < 0) {
-
-        // Clean resources and exit program
-        if (program_running == 0) { // pcap loop broken when ctrl+c pressed
-            print_summary();
-            clean();
-            exit(0);
-        } else { // pcap loop broken due to error
-            fprintf(stderr, "Unable to capture packets");
-            clean();
-            exit(1);
+    // Capture packets until interrupted (or the end of the file is reached), 
+    // polling capture statistics and passing the seconds which have been
+    // analysed to the detectors (evaluating thresholds over them) between
+    // each buffer of packets delivered by the kernel
+    int result = 0;
+    while (program_running == 1 && result >= 0) {
+        result = pcap_dispatch(pcap_handle, -1, dispatch, NULL);
+        flush_batches(result == 0);
+        poll_capture_stats(0);
+        advance_detectors(analysed_second(result == 0));
+        if (result == 0 && settings.read_file != NULL) {
+            break;
         }
     }
+
+    // Record final capture statistics once capture has stopped, and hand any
+    // partial batches to the threads
+    poll_capture_stats(1);
+    flush_batches(1);
+
+    // Let worker threads drain the queue before their detector state is read
+    // (analysing every packet of a replayed file), then evaluate thresholds 
+    // over the remaining seconds, flush packets the threads recorded and 
+    // write a final snapshot
+    int interrupted = (program_running == 0);
+    program_running = 0;
+    clean_threadpool((interrupted == 0 && result >= 0) ? -1 : settings.drain_timeout);
+    advance_detectors(analysed_second(1));
+    free_writer();
+    free_snapshots();
+
+    // Clean resources and exit program
+    if (result != PCAP_ERROR) { // capture loop broken by ctrl+c or end of file
+        print_summary();
+        clean();
+        exit(0);
+    } else { // capture loop broken due to error
+        fprintf(stderr, "Unable to capture packets: %s\n", pcap_geterr(pcap_handle));
+        clean();
+        exit(1);
+    }
 }
 
 
 /**
- * @brief Initialises the global attack_counts struct 
- * by setting the value of each field to 0.
- *
+ * @brief Opens a network interface for packet capture, applying the kernel
+ * buffer size, immediate mode, timeout and timestamp precision settings
+ * before activating it. Exits the program if the interface cannot be opened.
+ * 
+ * @param interface Network interface to open
  */
-void initialise_attack_counts() {
+void open_interface(char* interface) {
 
-    // Allocate memory for attack counter struct
-    attacks = (struct attack_counts*) malloc(sizeof(struct attack_counts));
-    if (attacks == NULL) {
-        fprintf(stderr, "Unable to allocate memory for attack counters\n");
-        exit(1);
+    char errbuf[PCAP_ERRBUF_SIZE];
+
+    pcap_handle = pcap_create(interface, errbuf);
+    if (pcap_handle == NULL) {
+        fprintf(stderr, "Unable to open interface %s\n", errbuf);
+        exit(EXIT_FAILURE);
+    }
+
+    // Apply settings, which must be done before the handle is activated
+    pcap_set_snaplen(pcap_handle, BUFSIZE);
+    pcap_set_promisc(pcap_handle, 1);
+    pcap_set_timeout(pcap_handle, settings.timeout);
+    if (settings.buffer_size > 0) {
+        pcap_set_buffer_size(pcap_handle, settings.buffer_size);
+    }
+    if (settings.immediate_mode == 1) {
+        pcap_set_immediate_mode(pcap_handle, 1);
+    }
+    if (settings.nanosecond_precision == 1
+        && pcap_set_tstamp_precision(pcap_handle, PCAP_TSTAMP_PRECISION_NANO) != 0) {
+        fprintf(stderr, "Nanosecond timestamps not supported, using microseconds\n");
+    }
+
+    // Activate handle, reporting any warnings and exiting on error
+    int status = pcap_activate(pcap_handle);
+    if (status < 0) {
+        fprintf(stderr, "Unable to open interface %s: %s\n", interface, pcap_geterr(pcap_handle));
+        pcap_close(pcap_handle);
+        exit(EXIT_FAILURE);
+    } else if (status > 0) {
+        fprintf(stderr, "Warning opening interface %s: %s\n", interface, pcap_statustostr(status));
+    }
+}
+
+
+/**
+ * @brief Opens a pcap file to replay its packets through the analyser. 
+ * Exits the program if the file cannot be opened.
+ * 
+ * @param file Path of pcap file to open
+ */
+void open_file(char* file) {
+
+    char errbuf[PCAP_ERRBUF_SIZE];
+
+    pcap_handle = pcap_open_offline_with_tstamp_precision(file, 
+        settings.nanosecond_precision ? PCAP_TSTAMP_PRECISION_NANO : PCAP_TSTAMP_PRECISION_MICRO, errbuf);
+    if (pcap_handle == NULL) {
+        fprintf(stderr, "Unable to open file %s\n", errbuf);
+        exit(EXIT_FAILURE);
     }
+}
+
 
-    // Set each individual count to 0
-    attacks->syn_packets = 0;
-    attacks->arp_responses = 0;
-    attacks->google = 0;
-    attacks->facebook = 0;
+/**
+ * @brief Adds the change in the statistics reported by the pcap handle since 
+ * the last poll to the global capture statistics. Counters are accumulated
+ * from differences so that the 32-bit counters of libpcap may wrap around.
+ * 
+ * @param force Poll even if less than STATS_INTERVAL seconds have passed
+ */
+void poll_capture_stats(int force) {
+
+    time_t now = time(NULL);
+    if (force == 0 && now - last_stats_poll < STATS_INTERVAL) {
+        return;
+    }
+    last_stats_poll = now;
+
+    struct pcap_stat stats;
+    if (pcap_stats(pcap_handle, &stats) != 0) {
+        return;
+    }
+    capture_stats.received += (unsigned int) (stats.ps_recv - last_stats.ps_recv);
+    capture_stats.dropped += (unsigned int) (stats.ps_drop - last_stats.ps_drop);
+    capture_stats.if_dropped += (unsigned int) (stats.ps_ifdrop - last_stats.ps_ifdrop);
+    last_stats = stats;
 }
 
 
 /**
  * @brief Handles receipt of an interrupt signal (SIGINT), updating the 
  * program_running flag to commence the cleanup process and breaking the 
- * pcap loop to cease packet sniffing.
+ * pcap loop to cease packet sniffing. Also handles SIGUSR1 by requesting
+ * a snapshot of detector state.
  *
  * @param signal The signal received represented as an integer.
  */
@@ -110,35 +215,36 @@ void signal_handler(int signal) {
         if (pcap_handle) {
             pcap_breakloop(pcap_handle);
         }
+    } else if (signal == SIGUSR1) {
+        request_snapshot();
     }
 }
 
 
 /**
- * @brief Displays the intrusion detection report consisting of the number
- * of different attacks/violations detected.
+ * @brief Displays the intrusion detection report consisting of the report
+ * of each enabled detector, merged across all worker threads.
  * 
  */
 void print_summary() {
     printf("\nIntrusion Detection Report:\n");
-    printf("%ld SYN packets detected from %ld different IPs (syn attack)\n", 
-        attacks->syn_packets,
-        ip_addresses.size
-    );
-    printf("%ld ARP responses (cache poisoning)\n", 
-        attacks->arp_responses
-    );
-    printf("%ld Blacklist violations (%ld google and %ld facebook)\n",
-        attacks->google + attacks->facebook,
-        attacks->google,
-        attacks->facebook
+    report_detectors(worker_contexts, THREADPOOL_SIZE);
+    report_thresholds();
+    report_writer();
+    report_snapshots();
+    report_threadpool();
+    printf("%ld packets captured (%ld received, %ld dropped by kernel, %ld dropped by interface)\n",
+        packet_count,
+        capture_stats.received,
+        capture_stats.dropped,
+        capture_stats.if_dropped
     );
 }
 
 
 /**
- * @brief Handles the closing of the network interface, cleaning
- * up of the threads and freeing memory allocated to structs.
+ * @brief Handles the closing of the network interface and freeing 
+ * memory allocated to the detector state of the (already joined) threads.
  * 
  */
 void clean() {
@@ -148,8 +254,7 @@ void clean() {
         pcap_close(pcap_handle);
     }
 
-    // Free memory allocated to structs and join threads
-    clean_threadpool();
-    free(attacks);
-    free_array(&ip_addresses);
+    // Free memory allocated to detector contexts and shared resources
+    free_worker_contexts();
+    cleanup_detectors();
 }
@@ -2,30 +2,48 @@
 #define CS241_SNIFF_H
 
 #include <sys/types.h>
+#include <signal.h>
 #include <pcap.h>
 
 #define BUFSIZE 4096
 
-// Struct storing the number of attacks/violations detected
-struct attack_counts {
-    unsigned long arp_responses;
-    unsigned long syn_packets;
-    unsigned long google;
-    unsigned long facebook;
+// Minimum number of seconds between polls of capture statistics
+#define STATS_INTERVAL 1
+
+// Struct storing settings of optional features, set from command line options
+struct settings {
+    char* write_prefix;
+    int context_packets;
+    int buffer_size;
+    int immediate_mode;
+    int timeout;
+    int nanosecond_precision;
+    int drain_timeout;
+    char* read_file;
+    int batch_size;
+    char* snapshot_file;
+    int snapshot_interval;
+};
+
+// Struct storing the number of packets received and dropped during capture
+struct capture_stats {
+    unsigned long received;
+    unsigned long dropped;
+    unsigned long if_dropped;
 };
 
-// Global flags and packet counter
+// Global flags, settings and packet counter
 extern int verbose_enabled;
-extern int program_running;
+extern volatile sig_atomic_t program_running;
+extern struct settings settings;
+extern struct capture_stats capture_stats;
 extern unsigned long packet_count;
 
-// Structs to store attack attack_counts and IP addresses of SYN packets
-extern struct attack_counts* attacks;
-extern struct dynamic_array ip_addresses;
-
 // Function prototypes
 void sniff(char* interface, int verbose);
-void initialise_attack_counts();
+void open_interface(char* interface);
+void open_file(char* file);
+void poll_capture_stats(int force);
 void signal_handler(int signal);
 void print_summary();
 void clean();
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Replays a capture several times with the same snapshot file, checking that
+# restored SYN detections accumulate across runs and survive a run in which
+# the SYN detector is not enabled.
+#
+# Usage: tests/snapshot_replay.sh ANALYSER CAPTURE
+# where CAPTURE is a pcap file holding at least one SYN packet
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 ANALYSER CAPTURE" >&2
+    exit 2
+fi
+analyser=$1
+capture=$2
+
+directory=$(mktemp -d) || exit 1
+trap 'rm -rf "$directory"' EXIT
+snapshot="$directory/snapshot"
+
+# Replays the capture with the given options, printing the number of SYN
+# packets reported (if the SYN detector is enabled)
+replay() {
+    "$analyser" -r "$capture" -s "$snapshot" "$@" \
+        | sed -n 's/^\([0-9]*\) SYN packets detected.*/\1/p'
+}
+
+# Checks that a replay reported the expected number of SYN packets
+expect() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: $1: expected $3 SYN packets, got '$2'" >&2
+        exit 1
+    fi
+    echo "ok: $1 ($2 SYN packets)"
+}
+
+single=$(replay)
+if [ -z "$single" ] || [ "$single" -eq 0 ]; then
+    echo "FAIL: capture holds no SYN packets" >&2
+    exit 1
+fi
+
+expect "second run restores first" "$(replay)" $((single * 2))
+replay -d arp > /dev/null
+expect "run without syn keeps its state" "$(replay)" $((single * 3))
+replay -d blacklist,arp > /dev/null
+expect "snapshot kept twice is not duplicated" "$(replay -d syn)" $((single * 4))